@@ -0,0 +1,747 @@
+// Benchmarks for the performance critical linear algebra kernels
+// Usage: ./bench <kernel> [n] [p] [threads]
+// The png kernel writes bench_scatter.png so it can be checked with any PNG decoder
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include "linalg.h"
+#include "simd.h"
+#include "pbPlots.h"
+#include "supportLib.h"
+#include "png.h"
+
+// Current time in seconds from a monotonic clock
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Generate an nxm matrix of uniform random values in [-1, 1] with a leading column of 1s like a regression X
+static Matrix random_matrix(size_t n, size_t m) {
+    Matrix X; size_t i, j;
+    X.n = n; X.m = X.ld = m;
+    X.data = (double*)aligned_malloc(n * m * sizeof(double));
+
+    for (i = 0; i < n; i++) {
+        X.data[(size_t)i * m] = 1.0;
+        for (j = 1; j < m; j++) {
+            X.data[(size_t)i * m + j] = 2.0 * rand() / RAND_MAX - 1.0;
+        }
+    }
+
+    return X;
+}
+
+// Largest absolute difference between the entries of two equally sized matrices
+static double max_difference(Matrix X, Matrix Y) {
+    double diff = 0.0;
+    size_t i;
+
+    for (i = 0; i < (size_t)X.n * X.m; i++) {
+        if (fabs(X.data[i] - Y.data[i]) > diff) {
+            diff = fabs(X.data[i] - Y.data[i]);
+        }
+    }
+
+    return diff;
+}
+
+// Classical Gram-Schmidt QR_factorise against Modified Gram-Schmidt QR_factorise_mgs
+static void bench_qr(int n, int p) {
+    Matrix X = random_matrix(n, p);
+    double start, classical, modified;
+    QR qr_classical, qr_modified;
+
+    printf("QR factorisation of a %dx%d matrix\n", n, p);
+
+    start = now_seconds();
+    qr_classical = QR_factorise(NULL, X);
+    classical = now_seconds() - start;
+    printf("  classical Gram-Schmidt (QR_factorise):     %8.3fs\n", classical);
+
+    start = now_seconds();
+    qr_modified = QR_factorise_mgs(NULL, X);
+    modified = now_seconds() - start;
+    printf("  modified Gram-Schmidt (QR_factorise_mgs):  %8.3fs  (%.1fx speedup)\n", modified, classical / modified);
+    printf("  max |R_classical - R_modified| = %.3e\n", max_difference(qr_classical.R, qr_modified.R));
+
+    free(qr_classical.Q.data);
+    free(qr_classical.R.data);
+    free(qr_modified.Q.data);
+    free(qr_modified.R.data);
+    free(X.data);
+}
+
+// Modified Gram-Schmidt (forming Q, then Q_T * y) against blocked Householder applying Q_T to y on the fly
+static void bench_householder(int n, int p) {
+    Matrix X = random_matrix(n, p), R;
+    Vector y, z_mgs, z_householder;
+    double start, modified, householder, diff = 0.0;
+    QR qr;
+    int i, j;
+
+    y.size = n;
+    y.stride = 1;
+    y.data = (double*)malloc((size_t)n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        y.data[i] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+
+    printf("Least squares R and Q_T*y of a %dx%d matrix\n", n, p);
+
+    start = now_seconds();
+    qr = QR_factorise_mgs(NULL, X);
+    z_mgs = multiply_transpose_matrix_vector(NULL, qr.Q, y);
+    modified = now_seconds() - start;
+    printf("  modified Gram-Schmidt + Q_T * y:                %8.3fs\n", modified);
+
+    start = now_seconds();
+    R = QR_factorise_householder(NULL, X, y, &z_householder);
+    householder = now_seconds() - start;
+    printf("  blocked Householder (QR_factorise_householder): %8.3fs  (%.1fx speedup)\n", householder, modified / householder);
+
+    // R and Q_T*y are unique up to the sign of each row
+    for (i = 0; i < p; i++) {
+        double sign = (R.data[i * p + i] < 0.0) == (qr.R.data[i * p + i] < 0.0) ? 1.0 : -1.0;
+        for (j = i; j < p; j++) {
+            diff = fmax(diff, fabs(sign * R.data[i * p + j] - qr.R.data[i * p + j]));
+        }
+        diff = fmax(diff, fabs(sign * z_householder.data[i] - z_mgs.data[i]));
+    }
+    printf("  max difference in R and Q_T*y = %.3e\n", diff);
+
+    free(qr.Q.data);
+    free(qr.R.data);
+    free(z_mgs.data);
+    free(R.data);
+    free(z_householder.data);
+    free(y.data);
+    free(X.data);
+}
+
+// Single threaded blocked Householder against TSQR on num_threads threads
+static void bench_tsqr(int n, int p, int num_threads) {
+    Matrix X = random_matrix(n, p), R_serial, R_parallel;
+    Vector y, z_serial, z_parallel, b_serial, b_parallel;
+    double start, serial, parallel, diff = 0.0;
+    int i;
+
+    y.size = n;
+    y.stride = 1;
+    y.data = (double*)malloc((size_t)n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        y.data[i] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+
+    printf("Least squares solve of a %dx%d matrix on %d threads (0 = all cores)\n", n, p, num_threads);
+
+    start = now_seconds();
+    R_serial = QR_factorise_householder(NULL, X, y, &z_serial);
+    b_serial = solve_back_sub(NULL, R_serial, z_serial);
+    serial = now_seconds() - start;
+    printf("  blocked Householder:  %8.3fs\n", serial);
+
+    start = now_seconds();
+    R_parallel = QR_factorise_tsqr(NULL, X, y, &z_parallel, num_threads);
+    b_parallel = solve_back_sub(NULL, R_parallel, z_parallel);
+    parallel = now_seconds() - start;
+    printf("  TSQR:                 %8.3fs  (%.1fx speedup)\n", parallel, serial / parallel);
+
+    for (i = 0; i < p; i++) {
+        diff = fmax(diff, fabs(b_serial.data[i] - b_parallel.data[i]));
+    }
+    printf("  max difference in coefficients = %.3e\n", diff);
+
+    free(R_serial.data);
+    free(z_serial.data);
+    free(b_serial.data);
+    free(R_parallel.data);
+    free(z_parallel.data);
+    free(b_parallel.data);
+    free(y.data);
+    free(X.data);
+}
+
+// Fixed-size Givens QR against blocked Householder for every p with a fixed-size kernel
+static void bench_small(int n) {
+    Matrix X, R_householder, R_givens;
+    Vector y, z_householder, z_givens, b_householder, b_givens;
+    double start, householder, givens, diff;
+    int i, p;
+
+    y.size = n;
+    y.stride = 1;
+    y.data = (double*)malloc((size_t)n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        y.data[i] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+
+    printf("Least squares solve of an %dxp matrix, p = %d..%d\n", n, SMALL_P_MIN, SMALL_P_MAX);
+    printf("   p   Householder      Givens   speedup   max difference in coefficients\n");
+
+    for (p = SMALL_P_MIN; p <= SMALL_P_MAX; p++) {
+        X = random_matrix(n, p);
+
+        start = now_seconds();
+        R_householder = QR_factorise_householder(NULL, X, y, &z_householder);
+        b_householder = solve_back_sub(NULL, R_householder, z_householder);
+        householder = now_seconds() - start;
+
+        start = now_seconds();
+        R_givens = QR_factorise_givens(NULL, X, y, &z_givens);
+        b_givens = solve_back_sub(NULL, R_givens, z_givens);
+        givens = now_seconds() - start;
+
+        diff = 0.0;
+        for (i = 0; i < p; i++) {
+            diff = fmax(diff, fabs(b_householder.data[i] - b_givens.data[i]));
+        }
+        printf("  %2d  %11.3fs %10.3fs %8.1fx   %.3e\n", p, householder, givens, householder / givens, diff);
+
+        free(R_householder.data);
+        free(z_householder.data);
+        free(b_householder.data);
+        free(R_givens.data);
+        free(z_givens.data);
+        free(b_givens.data);
+        free(X.data);
+    }
+
+    free(y.data);
+}
+
+// Repeated small least squares fits allocating every temporary with malloc against reusing one workspace
+static void bench_workspace(int n, int p) {
+    Matrix X = random_matrix(n, p), R;
+    Vector y, z, b;
+    Workspace ws;
+    double start, allocated, reused, diff = 0.0, b_0 = 0.0;
+    int i, reps = n >= 10000 ? 10 : 10000000 / (n * p + 1) + 1;
+
+    y.size = n;
+    y.stride = 1;
+    y.data = (double*)malloc((size_t)n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        y.data[i] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+
+    printf("%d least squares solves of a %dx%d matrix\n", reps, n, p);
+
+    start = now_seconds();
+    for (i = 0; i < reps; i++) {
+        R = QR_factorise_householder(NULL, X, y, &z);
+        b = solve_back_sub(NULL, R, z);
+        b_0 = b.data[0];
+        free(R.data);
+        free(z.data);
+        free(b.data);
+    }
+    allocated = now_seconds() - start;
+    printf("  malloc per temporary:  %8.3fs\n", allocated);
+
+    init_workspace(&ws);
+    start = now_seconds();
+    for (i = 0; i < reps; i++) {
+        workspace_reset(&ws);
+        R = QR_factorise_householder(&ws, X, y, &z);
+        b = solve_back_sub(&ws, R, z);
+        diff = fmax(diff, fabs(b.data[0] - b_0));
+    }
+    reused = now_seconds() - start;
+    printf("  reset workspace:       %8.3fs  (%.1fx speedup, peak %.2f MB in %zu bytes reserved)\n",
+           reused, allocated / reused, ws.peak / 1e6, ws.capacity);
+
+    printf("  difference in b_0 = %.3e\n", diff);
+
+    free_workspace(&ws);
+    free(y.data);
+    free(X.data);
+}
+
+// Next value of a xorshift64 generator, uniform in [-1, 1) - rand() is too slow to fill billions of entries
+static double xorshift_uniform(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (double)(*state >> 11) / (double)(1ULL << 52) - 1.0;
+}
+
+// Least squares on an nxp problem sized like production data (100M x 30 by default, over 2^31 entries), fitted
+// with the streamed normal equations and with TSQR on num_threads threads. y = X * b_true + noise so both fits
+// can be checked against the true coefficients. Needs about 8*n*(p+1) bytes, and TSQR as much again for its copy.
+static void bench_stress(size_t n, size_t p, int num_threads) {
+    Matrix X, gram, R;
+    Vector y, b_true, z, b;
+    unsigned long long state = 42;
+    double start, elapsed, error;
+    size_t i, j;
+
+    printf("Least squares stress test of a %zux%zu matrix (%zu entries, %s 32 bit indexing), %.2f GB for X and y\n",
+           n, p, n * p, n * p > INT_MAX ? "beyond" : "within", 8.0 * n * (p + 1) / 1e9);
+
+    X.n = n; X.m = X.ld = p;
+    y.size = n; y.stride = 1;
+    b_true.size = p; b_true.stride = 1;
+    X.data = (double*)aligned_malloc(n * p * sizeof(double));
+    y.data = (double*)aligned_malloc(n * sizeof(double));
+    b_true.data = (double*)aligned_malloc(p * sizeof(double));
+    if (X.data == NULL || y.data == NULL || b_true.data == NULL) {
+        free(X.data);
+        free(y.data);
+        free(b_true.data);
+        return;
+    }
+    for (j = 0; j < p; j++) {
+        b_true.data[j] = 1.0 + (double)j / p;
+    }
+
+    start = now_seconds();
+    for (i = 0; i < n; i++) {
+        double *x_i = X.data + i * X.ld, y_i = 0.0;
+        x_i[0] = 1.0;
+        for (j = 1; j < p; j++) {
+            x_i[j] = xorshift_uniform(&state);
+        }
+        for (j = 0; j < p; j++) {
+            y_i += x_i[j] * b_true.data[j];
+        }
+        y.data[i] = y_i + 1e-3 * xorshift_uniform(&state);
+    }
+    printf("  generate:                  %8.3fs\n", now_seconds() - start);
+
+    start = now_seconds();
+    gram = multiply_transpose_matrix_self(NULL, X);
+    z = multiply_transpose_matrix_vector(NULL, X, y);
+    if (cholesky_factorise_inplace(&gram)) {
+        b = solve_cholesky(NULL, gram, z);
+        for (j = 0, error = 0.0; j < p; j++) {
+            error = fmax(error, fabs(b.data[j] - b_true.data[j]));
+        }
+        elapsed = now_seconds() - start;
+        printf("  normal equations:          %8.3fs  (%.2f GB/s, max coefficient error %.3e)\n", elapsed,
+               8.0 * n * (p + 1) / 1e9 / elapsed, error);
+        free(b.data);
+    } else {
+        printf("  normal equations: X_T*X is too ill-conditioned\n");
+    }
+    free(gram.data);
+    free(z.data);
+
+    start = now_seconds();
+    R = QR_factorise_tsqr(NULL, X, y, &z, num_threads);
+    b = solve_back_sub(NULL, R, z);
+    for (j = 0, error = 0.0; j < p; j++) {
+        error = fmax(error, fabs(b.data[j] - b_true.data[j]));
+    }
+    printf("  TSQR (%d threads, 0 = all):  %8.3fs  (max coefficient error %.3e)\n", num_threads, now_seconds() - start, error);
+
+    free(R.data);
+    free(z.data);
+    free(b.data);
+    free(b_true.data);
+    free(y.data);
+    free(X.data);
+}
+
+// The original i-j-k triple loop, as a baseline
+static void gemm_naive(int n, int m, int k, const double *A, const double *B, double *C) {
+    int i, j, kk;
+    double res;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < m; j++) {
+            res = 0.0;
+            for (kk = 0; kk < k; kk++) {
+                res += A[(size_t)i * k + kk] * B[(size_t)kk * m + j];
+            }
+            C[(size_t)i * m + j] = res;
+        }
+    }
+}
+
+// Naive triple loop against the blocked multiply with each microkernel this CPU supports, for n x n matrices
+static void bench_gemm(int n) {
+    Matrix A = random_matrix(n, n), B = random_matrix(n, n), C_naive, C;
+    double start, naive, blocked, gflops = 2.0 * n * n * (double)n / 1e9;
+    SimdLevel level;
+
+    C_naive.n = C_naive.m = C_naive.ld = C.n = C.m = C.ld = n;
+    C_naive.data = (double*)malloc((size_t)n * n * sizeof(double));
+    C.data = (double*)malloc((size_t)n * n * sizeof(double));
+
+    printf("Matrix multiply of two %dx%d matrices\n", n, n);
+
+    start = now_seconds();
+    gemm_naive(n, n, n, A.data, B.data, C_naive.data);
+    naive = now_seconds() - start;
+    printf("  naive triple loop:  %8.3fs  (%.2f GFLOP/s)\n", naive, gflops / naive);
+
+    for (level = SIMD_SCALAR; level <= simd_level(); level++) {
+        start = now_seconds();
+        gemm(level, n, n, n, A.data, A.ld, B.data, B.ld, C.data, C.ld);
+        blocked = now_seconds() - start;
+        printf("  blocked %-10s  %8.3fs  (%.2f GFLOP/s, %.1fx speedup, max error %.3e)\n", simd_level_name(level),
+               blocked, gflops / blocked, naive / blocked, max_difference(C_naive, C));
+    }
+
+    free(A.data);
+    free(B.data);
+    free(C_naive.data);
+    free(C.data);
+}
+
+// Transpose then multiply against the fused X_T*X and X_T*y kernels, for a regression sized nxp X
+static void bench_gram(int n, int p) {
+    Matrix X = random_matrix(n, p), X_T, gram_copy, gram_fused;
+    Vector y, z_copy, z_fused;
+    double start, copied, fused;
+    int i;
+
+    y.size = n;
+    y.stride = 1;
+    y.data = (double*)malloc((size_t)n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        y.data[i] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+
+    printf("X_T*X and X_T*y of a %dx%d matrix\n", n, p);
+
+    start = now_seconds();
+    X_T = transpose_matrix(NULL, X);
+    gram_copy = multiply_matrix_matrix(NULL, X_T, X);
+    z_copy = multiply_matrix_vector(NULL, X_T, y);
+    copied = now_seconds() - start;
+    printf("  transpose_matrix + multiply:  %8.3fs\n", copied);
+
+    start = now_seconds();
+    gram_fused = multiply_transpose_matrix_self(NULL, X);
+    z_fused = multiply_transpose_matrix_vector(NULL, X, y);
+    fused = now_seconds() - start;
+    printf("  fused transpose kernels:      %8.3fs  (%.1fx speedup, max error %.3e)\n", fused, copied / fused,
+           max_difference(gram_copy, gram_fused));
+
+    free(X_T.data);
+    free(gram_copy.data);
+    free(z_copy.data);
+    free(gram_fused.data);
+    free(z_fused.data);
+    free(y.data);
+    free(X.data);
+}
+
+// Each BLAS-1 kernel at each instruction set this CPU supports, on vectors of length n
+static void bench_blas1(int n) {
+    double *x = (double*)malloc((size_t)n * sizeof(double));
+    double *y = (double*)malloc((size_t)n * sizeof(double));
+    double start, elapsed, result = 0.0, huge[3] = {3e200, 4e200, 0.0};
+    int reps = 200000000 / n + 1, i, r;
+    SimdLevel level;
+
+    for (i = 0; i < n; i++) {
+        x[i] = 2.0 * rand() / RAND_MAX - 1.0;
+        y[i] = 2.0 * rand() / RAND_MAX - 1.0;
+    }
+
+    printf("BLAS-1 kernels on vectors of length %d (%d repetitions)\n", n, reps);
+    for (level = SIMD_SCALAR; level <= simd_level(); level++) {
+        start = now_seconds();
+        for (r = 0; r < reps; r++) {
+            result += blas_dot(level, n, x, y);
+        }
+        elapsed = now_seconds() - start;
+        printf("  dot   %-7s %8.3fs  (%.2f GB/s)\n", simd_level_name(level), elapsed, 16.0 * n * reps / elapsed / 1e9);
+
+        start = now_seconds();
+        for (r = 0; r < reps; r++) {
+            result += blas_nrm2(level, n, x);
+        }
+        elapsed = now_seconds() - start;
+        printf("  nrm2  %-7s %8.3fs  (%.2f GB/s)\n", simd_level_name(level), elapsed, 8.0 * n * reps / elapsed / 1e9);
+
+        start = now_seconds();
+        for (r = 0; r < reps; r++) {
+            blas_axpy(level, n, r % 2 == 0 ? 1e-3 : -1e-3, x, y);
+        }
+        elapsed = now_seconds() - start;
+        printf("  axpy  %-7s %8.3fs  (%.2f GB/s)\n", simd_level_name(level), elapsed, 24.0 * n * reps / elapsed / 1e9);
+
+        start = now_seconds();
+        for (r = 0; r < reps; r++) {
+            blas_scal(level, n, r % 2 == 0 ? 2.0 : 0.5, x);
+        }
+        elapsed = now_seconds() - start;
+        printf("  scal  %-7s %8.3fs  (%.2f GB/s)\n", simd_level_name(level), elapsed, 16.0 * n * reps / elapsed / 1e9);
+    }
+
+    // |(3e200, 4e200)| = 5e200 overflows a plain sum of squares
+    printf("  nrm2 of (3e200, 4e200, 0) = %.3e (checksum %.3e)\n", blas_nrm2(simd_level(), 3, huge), result);
+
+    free(x);
+    free(y);
+}
+
+// Time the old brute force FindMatch over data, as DeflateDataStaticHuffman used to call it
+static double find_match_seconds(double *data, size_t length, double level) {
+    NumberReference *distance = CreateNumberReference(0.0), *match_length = CreateNumberReference(0.0);
+    BooleanReference *match = (BooleanReference*)malloc(sizeof(BooleanReference));
+    double start = now_seconds(), i;
+
+    for (i = 0.0; i < length; ) {
+        FindMatch(data, length, i, distance, match_length, match, level);
+        i += match->booleanValue ? match_length->numberValue : 1.0;
+    }
+
+    free(distance);
+    free(match_length);
+    free(match);
+    return now_seconds() - start;
+}
+
+// Render an n point scatter plot at the 1000x800 size of plot_results and encode it as a PNG
+static void bench_png(int n) {
+    double *xs = (double*)malloc((size_t)n * sizeof(double));
+    double *ys = (double*)malloc((size_t)n * sizeof(double));
+    double levels[] = {0.0, 0.001, 1.0, 10.0};
+    double start, elapsed, *png, *color_data;
+    size_t png_length, color_length;
+    int i, l;
+
+    for (i = 0; i < n; i++) {
+        xs[i] = 100.0 * rand() / RAND_MAX;
+        ys[i] = 4.2 * xs[i] - 106.0 + 40.0 * rand() / RAND_MAX;
+    }
+
+    ScatterPlotSeries *series = GetDefaultScatterPlotSeriesSettings();
+    series->xs = xs;
+    series->xsLength = n;
+    series->ys = ys;
+    series->ysLength = n;
+    series->linearInterpolation = false;
+    series->pointType = L"circles";
+    series->pointTypeLength = wcslen(series->pointType);
+    series->color = GetBlack();
+
+    ScatterPlotSettings *settings = GetDefaultScatterPlotSettings();
+    settings->width = 1000;
+    settings->height = 800;
+    settings->autoBoundaries = true;
+    settings->autoPadding = true;
+    ScatterPlotSeries *s[] = {series};
+    settings->scatterPlotSeries = s;
+    settings->scatterPlotSeriesLength = 1;
+
+    RGBABitmapImageReference *canvas = CreateRGBABitmapImageReference();
+    start = now_seconds();
+    DrawScatterPlotFromSettings(canvas, settings);
+    printf("Scatter plot of %d points at 1000x800: drawn in %.3fs\n", n, now_seconds() - start);
+
+    // The same points binned into per-pixel counts, whose cost hardly grows with n
+    RGBABitmapImageReference *density_canvas = CreateRGBABitmapImageReference();
+    series->pointType = L"density";
+    series->pointTypeLength = wcslen(series->pointType);
+    start = now_seconds();
+    DrawScatterPlotFromSettings(density_canvas, settings);
+    printf("  as a density plot: drawn in %.3fs\n", now_seconds() - start);
+    DeleteImage(density_canvas->image);
+    free(density_canvas);
+
+    // Tiled rasteriser against the serial path: every marker type must come out byte for byte the same
+    if (n < SCATTER_TILE_MIN_POINTS) {
+        printf("  (%d points is below SCATTER_TILE_MIN_POINTS = %d, so the tiled runs below take the serial path too)\n", n, SCATTER_TILE_MIN_POINTS);
+    }
+    {
+        const wchar_t *point_types[] = {L"crosses", L"circles", L"dots", L"triangles", L"filled triangles", L"pixels"};
+        double thread_counts[] = {2.0, 4.0, (double)sysconf(_SC_NPROCESSORS_ONLN)};
+        RGBABitmapImage *serial, *tiled;
+        double serial_time;
+        int p, t;
+
+        for (p = 0; p < 6; p++) {
+            series->pointType = (wchar_t*)point_types[p];
+            series->pointTypeLength = wcslen(series->pointType);
+
+            serial = CreateImage(1000, 800, GetWhite());
+            start = now_seconds();
+            DrawScatterPlotPoints(serial, series, 0.0, 100.0, -110.0, 340.0, 50.0, 950.0, 750.0, 50.0, 1.0);
+            serial_time = now_seconds() - start;
+            printf("  %-16ls serial %8.3fs", series->pointType, serial_time);
+
+            for (t = 0; t < 3; t++) {
+                tiled = CreateImage(1000, 800, GetWhite());
+                start = now_seconds();
+                DrawScatterPlotPoints(tiled, series, 0.0, 100.0, -110.0, 340.0, 50.0, 950.0, 750.0, 50.0, thread_counts[t]);
+                elapsed = now_seconds() - start;
+                printf("  %g threads %8.3fs%s", thread_counts[t], elapsed,
+                       memcmp(serial->pixels, tiled->pixels, 4 * 1000 * 800) == 0 ? "" : " (DIFFERS)");
+                DeleteImage(tiled);
+            }
+            printf("\n");
+            DeleteImage(serial);
+        }
+        series->pointType = L"circles";
+        series->pointTypeLength = wcslen(series->pointType);
+    }
+
+    color_data = GetPNGColorData(&color_length, canvas->image);
+    for (l = 0; l < 4; l++) {
+        start = now_seconds();
+        png = ConvertToPNGWithOptions(&png_length, canvas->image, 6.0, false, 0.0, levels[l]);
+        elapsed = now_seconds() - start;
+        printf("  level %-6g  PNG %9zu bytes  %8.3fs", levels[l], png_length, elapsed);
+
+        // The brute force search gets slower with the level, so only time it where it finishes
+        if (levels[l] <= 1.0) {
+            printf("  (brute force FindMatch alone %8.3fs)", find_match_seconds(color_data, color_length, levels[l]));
+        }
+        printf("\n");
+
+        free(png);
+    }
+
+    // Whole save at the default level: pbPlots' double-per-byte path against the byte-native encoder
+    start = now_seconds();
+    png = ConvertToPNG(&png_length, canvas->image);
+    WriteToFile(png, png_length, "bench_scatter.png");
+    printf("  ConvertToPNG + WriteToFile  %8.3fs\n", now_seconds() - start);
+    free(png);
+
+    start = now_seconds();
+    png_save(canvas->image, "bench_scatter.png");
+    printf("  png_save                    %8.3fs\n", now_seconds() - start);
+
+    free(color_data);
+    free(xs);
+    free(ys);
+}
+
+// Bit at a time CRC-32 and byte at a time Adler-32, the references for bench_checksum
+static uint32_t crc32_reference(const uint8_t *data, size_t length) {
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i;
+    int k;
+
+    for (i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? CHECKSUM_CRC32_POLY ^ (crc >> 1) : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t adler32_reference(const uint8_t *data, size_t length) {
+    uint32_t a = 1, b = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        a = (a + data[i]) % CHECKSUM_ADLER_BASE;
+        b = (b + a) % CHECKSUM_ADLER_BASE;
+    }
+    return b << 16 | a;
+}
+
+// CRC-32 and Adler-32 of n random bytes at each instruction set, against pbPlots' double-per-byte CRC
+static void bench_checksum(size_t n) {
+    uint8_t *data = (uint8_t*)malloc(n);
+    size_t sample = n < 1000000 ? n : 1000000, i;
+    double *doubles = (double*)malloc(sample * sizeof(double)), *table, start, elapsed;
+    size_t table_length;
+    uint32_t crc_ref, adler_ref, crc = 0, adler = 0;
+    int reps = (int)(1000000000 / n) + 1, r, offset;
+    SimdLevel level;
+
+    for (i = 0; i < n; i++) {
+        data[i] = (uint8_t)rand();
+    }
+    for (i = 0; i < sample; i++) {
+        doubles[i] = data[i];
+    }
+    crc_ref = crc32_reference(data, n);
+    adler_ref = adler32_reference(data, n);
+
+    printf("Checksums of %zu bytes (%d repetitions)\n", n, reps);
+
+    start = now_seconds();
+    table = MakeCRC32Table(&table_length);
+    UpdateCRC32(4294967295.0, doubles, sample, table, table_length);
+    elapsed = now_seconds() - start;
+    printf("  crc32    pbPlots doubles %8.3fs  (%.3f GB/s over %zu bytes)\n", elapsed, sample / elapsed / 1e9, sample);
+
+    for (level = SIMD_SCALAR; level <= simd_level(); level++) {
+        start = now_seconds();
+        for (r = 0; r < reps; r++) {
+            crc = checksum_crc32(level, 0, data, n);
+        }
+        elapsed = now_seconds() - start;
+        printf("  crc32    %-15s %8.3fs  (%.2f GB/s)  %s\n", level == SIMD_SCALAR ? "slice-by-8" : "pclmul",
+               elapsed, (double)n * reps / elapsed / 1e9, crc == crc_ref ? "ok" : "MISMATCH");
+
+        start = now_seconds();
+        for (r = 0; r < reps; r++) {
+            adler = checksum_adler32(level, 1, data, n);
+        }
+        elapsed = now_seconds() - start;
+        printf("  adler32  %-15s %8.3fs  (%.2f GB/s)  %s\n", level == SIMD_SCALAR ? "scalar" : "avx2",
+               elapsed, (double)n * reps / elapsed / 1e9, adler == adler_ref ? "ok" : "MISMATCH");
+
+        // Unaligned starts, odd lengths and incremental updates must agree with the references too
+        for (offset = 0; offset < 67; offset += 11) {
+            size_t length = n - offset < 4099 ? n - offset : 4099 - (size_t)offset;
+            uint32_t split_crc = checksum_crc32(level, checksum_crc32(level, 0, data + offset, length / 3),
+                                                data + offset + length / 3, length - length / 3);
+            uint32_t split_adler = checksum_adler32(level, checksum_adler32(level, 1, data + offset, length / 3),
+                                                    data + offset + length / 3, length - length / 3);
+            if (split_crc != crc32_reference(data + offset, length) || split_adler != adler32_reference(data + offset, length)) {
+                printf("  MISMATCH at offset %d length %zu\n", offset, length);
+            }
+        }
+    }
+
+    free(table);
+    free(doubles);
+    free(data);
+}
+
+int main(int argc, char **argv) {
+    char *kernel = argc > 1 ? argv[1] : "qr";
+    int n = argc > 2 ? atoi(argv[2]) : 1000000;
+    int p = argc > 3 ? atoi(argv[3]) : 50;
+    int num_threads = argc > 4 ? atoi(argv[4]) : 0;
+
+    srand(42);
+
+    if (strcmp(kernel, "qr") == 0) {
+        bench_qr(n, p);
+    } else if (strcmp(kernel, "householder") == 0) {
+        bench_householder(n, p);
+    } else if (strcmp(kernel, "small") == 0) {
+        bench_small(n);
+    } else if (strcmp(kernel, "tsqr") == 0) {
+        bench_tsqr(n, p, num_threads);
+    } else if (strcmp(kernel, "workspace") == 0) {
+        bench_workspace(argc > 2 ? n : 1000, argc > 3 ? p : 8);
+    } else if (strcmp(kernel, "gram") == 0) {
+        bench_gram(n, p);
+    } else if (strcmp(kernel, "stress") == 0) {
+        bench_stress(argc > 2 ? strtoull(argv[2], NULL, 10) : 100000000, argc > 3 ? (size_t)p : 30, num_threads);
+    } else if (strcmp(kernel, "blas1") == 0) {
+        bench_blas1(argc > 2 ? n : 4096);
+    } else if (strcmp(kernel, "gemm") == 0) {
+        bench_gemm(argc > 2 ? n : 1000);
+    } else if (strcmp(kernel, "png") == 0) {
+        bench_png(argc > 2 ? n : 10000);
+    } else if (strcmp(kernel, "checksum") == 0) {
+        bench_checksum(argc > 2 ? (size_t)n : 1 << 24);
+    } else {
+        printf("Unknown kernel `%s`. Available: qr, householder, small, tsqr, workspace, gram, stress, gemm, blas1, png, checksum\n", kernel);
+        return 1;
+    }
+
+    return 0;
+}
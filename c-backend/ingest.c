@@ -0,0 +1,371 @@
+// Single-pass streaming ingest of CSV input shared by simple and multiple regression
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ingest.h"
+
+#define INGEST_CHUNK_SIZE (1 << 20)
+
+/* Regular files are memory mapped and every line is parsed directly out of the mapped
+   pages, so nothing is copied and there is no line length limit. Input that cannot be
+   mapped (pipes, stdin) is read in large chunks into a growable buffer instead, parsing
+   every complete line as soon as it is available. A line that is cut off at the end of
+   a chunk is carried over to the front of the buffer, and the buffer doubles whenever a
+   single line does not fit in it. Either way counting and parsing happen in one pass.
+*/
+
+// Seconds elapsed since start
+static double seconds_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Make sure buffer can hold `needed` doubles, doubling its capacity when it has to grow
+// Returns the buffer, or NULL if it could not grow - then buffer and *capacity are left as they were
+double *grow_buffer(double *buffer, size_t *capacity, size_t needed) {
+    size_t new_capacity = *capacity;
+    double *grown;
+
+    if (needed <= *capacity) {
+        return buffer;
+    }
+
+    if (new_capacity < 1024) {
+        new_capacity = 1024;
+    }
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+
+    grown = (double*)realloc(buffer, new_capacity * sizeof(double));
+    if (grown == NULL) {
+        printf("ERROR in reading data. Could not allocate %zu bytes\n", new_capacity * sizeof(double));
+        return NULL;
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+// Exact powers of ten representable as doubles, used by the fast path of parse_double
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parse a decimal floating point number from [*cursor, end) without sscanf/strtod
+// The format is [+-]digits[.digits][(e|E)[+-]digits] with '.' as the decimal point regardless of locale
+// Returns 1 and advances *cursor past the number on success, or 0 if no number starts at *cursor
+int parse_double(const char **cursor, const char *end, double *value) {
+    const char *ptr = *cursor;
+    unsigned long long mantissa = 0;
+    int negative = 0, digits = 0, significant = 0, exponent = 0;
+    double result;
+
+    if (ptr < end && (*ptr == '-' || *ptr == '+')) {
+        negative = *ptr == '-';
+        ptr++;
+    }
+
+    // Integer part: keep up to 19 significant digits exactly, the rest only scale the value
+    for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++, digits++) {
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (unsigned long long)(*ptr - '0');
+            significant += mantissa != 0;
+        } else {
+            exponent++;
+        }
+    }
+
+    // Fractional part
+    if (ptr < end && *ptr == '.') {
+        for (ptr++; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++, digits++) {
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (unsigned long long)(*ptr - '0');
+                significant += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+
+    if (digits == 0) {
+        return 0;
+    }
+
+    // Exponent - only consumed if at least one digit follows the 'e'
+    if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+        const char *exp_ptr = ptr + 1;
+        int exp_negative = 0, exp_value = 0;
+
+        if (exp_ptr < end && (*exp_ptr == '-' || *exp_ptr == '+')) {
+            exp_negative = *exp_ptr == '-';
+            exp_ptr++;
+        }
+        if (exp_ptr < end && *exp_ptr >= '0' && *exp_ptr <= '9') {
+            for (; exp_ptr < end && *exp_ptr >= '0' && *exp_ptr <= '9'; exp_ptr++) {
+                if (exp_value < 100000) {
+                    exp_value = exp_value * 10 + (*exp_ptr - '0');
+                }
+            }
+            exponent += exp_negative ? -exp_value : exp_value;
+            ptr = exp_ptr;
+        }
+    }
+
+    // Fast path: both the mantissa and the power of ten are exact doubles so one
+    // multiplication or division gives the correctly rounded result
+    if (mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        result = (double)mantissa;
+        result = exponent < 0 ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+    } else if (mantissa == 0) {
+        result = 0.0;
+    } else {
+        // Slow path for very long mantissas or large exponents, in extended precision
+        result = (double)((long double)mantissa * powl(10.0L, exponent));
+    }
+
+    *value = negative ? -result : result;
+    *cursor = ptr;
+    return 1;
+}
+
+// Parse a line of comma separated doubles in [line, end) into row
+// Returns the number of fields, 0 for a blank line, -1 if the line is malformed or -2 if row could not grow
+static int parse_line(const char *line, const char *end, double **row, size_t *row_capacity) {
+    const char *ptr = line;
+    double *grown;
+    int fields = 0;
+
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r')) {
+        ptr++;
+    }
+    if (ptr == end) {
+        return 0;
+    }
+
+    for (;;) {
+        double value;
+        if (parse_double(&ptr, end, &value) == 0) {
+            return -1;
+        }
+
+        grown = grow_buffer(*row, row_capacity, fields + 1);
+        if (grown == NULL) {
+            return -2;
+        }
+        *row = grown;
+        (*row)[fields++] = value;
+
+        // consume whitespace and the separating comma
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r')) {
+            ptr++;
+        }
+        if (ptr == end) {
+            return fields;
+        }
+        if (*ptr != ',') {
+            return -1;
+        }
+        ptr++;
+        while (ptr < end && (*ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+        }
+    }
+}
+
+// Parse the single line [line, end) and hand it to the callback if it is a valid row
+// Returns 0, or -1 if the ingest has to stop because memory ran out or the callback asked to
+static int handle_line(const char *line, const char *end, long long line_number, double **row, size_t *row_capacity,
+                        IngestRowCallback callback, void *ctx, IngestStats *stats) {
+    int fields = parse_line(line, end, row, row_capacity);
+
+    if (fields == 0) {
+        return 0;
+    }
+    if (fields == -2) {
+        return -1;
+    }
+
+    // The first valid row fixes the number of columns for the rest of the file
+    if (fields > 0 && stats->cols == 0) {
+        stats->cols = fields;
+    }
+
+    if (fields < 0 || fields != stats->cols) {
+        fprintf(stderr, "Invalid line format at line %lld: %.*s\n", line_number, (int)(end - line), line);
+        return 0;
+    }
+
+    if (callback(*row, fields, ctx) != 0) {
+        return -1;
+    }
+    stats->rows++;
+    return 0;
+}
+
+// Parse every line of an in-memory buffer in place, without copying it
+// Returns 0, or -1 if the ingest was stopped part way
+static int ingest_memory(const char *data, size_t length, IngestRowCallback callback, void *ctx, IngestStats *stats) {
+    const char *ptr = data, *end = data + length, *newline;
+    double *row = NULL;
+    size_t row_capacity = 0;
+    long long line_number = 0;
+    int status = 0;
+
+    while (ptr < end && status == 0) {
+        newline = (const char*)memchr(ptr, '\n', end - ptr);
+        if (newline == NULL) {
+            newline = end; // the last line need not end with a newline
+        }
+        status = handle_line(ptr, newline, ++line_number, &row, &row_capacity, callback, ctx, stats);
+        ptr = newline + 1;
+    }
+
+    stats->bytes += length;
+    free(row);
+    return status;
+}
+
+// Stream every row from a FILE* through a growable buffer - used for pipes and stdin, which cannot be mapped
+// Returns 0, or -1 if the ingest was stopped part way
+static int ingest_buffered(FILE *fptr, IngestRowCallback callback, void *ctx, IngestStats *stats) {
+    char *buffer, *grown, *newline;
+    size_t capacity = INGEST_CHUNK_SIZE, filled = 0, line_start, got;
+    double *row = NULL;
+    size_t row_capacity = 0;
+    long long line_number = 0;
+    int status = 0;
+
+    buffer = (char*)malloc(capacity);
+    if (buffer == NULL) {
+        printf("ERROR in reading data. Could not allocate %zu bytes\n", capacity);
+        return -1;
+    }
+
+    while (status == 0) {
+        got = fread(buffer + filled, 1, capacity - filled, fptr);
+        stats->bytes += got;
+        filled += got;
+
+        // Parse every complete line currently in the buffer
+        line_start = 0;
+        while (status == 0 && (newline = (char*)memchr(buffer + line_start, '\n', filled - line_start)) != NULL) {
+            status = handle_line(buffer + line_start, newline, ++line_number, &row, &row_capacity, callback, ctx, stats);
+            line_start = newline - buffer + 1;
+        }
+
+        if (got == 0 || status != 0) {
+            // End of input - the last line need not end with a newline
+            if (status == 0 && line_start < filled) {
+                status = handle_line(buffer + line_start, buffer + filled, ++line_number, &row, &row_capacity, callback, ctx, stats);
+            }
+            break;
+        }
+
+        // Carry the incomplete last line over to the front of the buffer
+        memmove(buffer, buffer + line_start, filled - line_start);
+        filled -= line_start;
+
+        // No line length limit: grow the buffer when a single line fills it
+        if (filled == capacity) {
+            grown = (char*)realloc(buffer, capacity * 2);
+            if (grown == NULL) {
+                printf("ERROR in reading data. Could not allocate %zu bytes\n", capacity * 2);
+                status = -1;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+    }
+
+    free(buffer);
+    free(row);
+    return status;
+}
+
+// Stream every row of the csv file to callback in a single pass over the file
+// Regular files are memory mapped and parsed in place; pipes and `-` (stdin) fall back to buffered reads
+// Returns 0 on success and -1 if the file could not be opened or the ingest was stopped part way
+int ingest_rows(char *filename, IngestRowCallback callback, void *ctx, IngestStats *stats) {
+    struct timespec start;
+    struct stat info;
+    FILE *fptr;
+    int fd, status;
+
+    stats->bytes = 0;
+    stats->rows = 0;
+    stats->cols = 0;
+    stats->seconds = 0.0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (strcmp(filename, "-") == 0) {
+        status = ingest_buffered(stdin, callback, ctx, stats);
+        stats->seconds = seconds_since(start);
+        return status;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Not able to open the file: `%s`\n", filename);
+        return -1;
+    }
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL);
+            status = ingest_memory((const char*)mapped, (size_t)info.st_size, callback, ctx, stats);
+            munmap(mapped, (size_t)info.st_size);
+            close(fd);
+            stats->seconds = seconds_since(start);
+            return status;
+        }
+    }
+
+    // Not mappable (pipe, device, empty or mmap failure) - read it through a buffer instead
+    fptr = fdopen(fd, "r");
+    if (fptr == NULL) {
+        close(fd);
+        printf("Not able to open the file: `%s`\n", filename);
+        return -1;
+    }
+    status = ingest_buffered(fptr, callback, ctx, stats);
+    fclose(fptr);
+
+    stats->seconds = seconds_since(start);
+    return status;
+}
+
+// Stream every row of csv text already in memory to callback, parsing it in place
+// Returns 0 on success and -1 if the ingest was stopped part way - unlike a file, a buffer cannot fail to open
+int ingest_buffer(const char *data, size_t length, IngestRowCallback callback, void *ctx, IngestStats *stats) {
+    struct timespec start;
+    int status;
+
+    stats->bytes = 0;
+    stats->rows = 0;
+    stats->cols = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = ingest_memory(data, length, callback, ctx, stats);
+    stats->seconds = seconds_since(start);
+    return status;
+}
+
+// Print how much was read and the throughput of the ingest pass
+void print_ingest_stats(char *filename, IngestStats *stats) {
+    double megabytes = stats->bytes / 1e6;
+    double throughput = stats->seconds > 0.0 ? megabytes / stats->seconds : 0.0;
+
+    printf("Read %lld rows x %d columns (%.2f MB) from `%s` in %.3fs (%.1f MB/s)\n",
+           stats->rows, stats->cols, megabytes, filename, stats->seconds, throughput);
+}
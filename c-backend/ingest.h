@@ -0,0 +1,30 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// STRUCTS
+struct IngestStats;
+typedef struct IngestStats IngestStats;
+
+// Struct for the statistics gathered over a single ingest pass of an input file
+struct IngestStats {
+    size_t bytes;   // number of bytes read from the file
+    long long rows; // number of valid rows handed to the row callback
+    int cols;       // number of fields on each row (set by the first valid row)
+    double seconds; // wall clock time spent reading and parsing
+};
+
+// Called once per valid row with the `cols` parsed fields of that row
+// Returns 0 to carry on, or -1 to stop the ingest (e.g. when out of memory)
+typedef int (*IngestRowCallback)(const double *row, int cols, void *ctx);
+
+// FUNCTION DEFINITIONS
+int ingest_rows(char *filename, IngestRowCallback callback, void *ctx, IngestStats *stats);
+int ingest_buffer(const char *data, size_t length, IngestRowCallback callback, void *ctx, IngestStats *stats);
+int parse_double(const char **cursor, const char *end, double *value);
+double *grow_buffer(double *buffer, size_t *capacity, size_t needed);
+void print_ingest_stats(char *filename, IngestStats *stats);
+
+#endif
@@ -2,14 +2,248 @@
 #include <stdio.h>
 #include <string.h> 
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "linalg.h"
+#include "simd.h"
+
+// ALIGNED STORAGE ------
+
+// Allocate bytes aligned to ARRAY_ALIGNMENT, returned memory is freed with free() like malloc's
+// With LINALG_HUGE_PAGES, arrays of at least HUGE_PAGE_SIZE are aligned to a huge page and advised to use them
+void *aligned_malloc(size_t bytes) {
+    size_t alignment = ARRAY_ALIGNMENT;
+    void *ptr;
+
+#ifdef LINALG_HUGE_PAGES
+    if (bytes >= HUGE_PAGE_SIZE) {
+        alignment = HUGE_PAGE_SIZE;
+    }
+#endif
+    if (posix_memalign(&ptr, alignment, bytes > 0 ? bytes : 1) != 0) {
+        printf("ERROR in allocating memory. Could not allocate %zu bytes\n", bytes);
+        return NULL;
+    }
+#if defined(LINALG_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    if (alignment == HUGE_PAGE_SIZE) {
+        // only a hint: without transparent huge pages the memory is simply backed by normal pages
+        madvise(ptr, bytes / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+    }
+#endif
+    return ptr;
+}
+
+// Allocate count * size zeroed bytes aligned like aligned_malloc()
+void *aligned_calloc(size_t count, size_t size) {
+    void *ptr = aligned_malloc(count * size);
+
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+// WORKSPACE ------
+
+// Round bytes up to a whole number of ARRAY_ALIGNMENT
+static size_t workspace_round(size_t bytes) {
+    return (bytes + ARRAY_ALIGNMENT - 1) / ARRAY_ALIGNMENT * ARRAY_ALIGNMENT;
+}
+
+// Add a block of at least size bytes in front of the workspace's blocks, returns NULL if it could not be allocated
+static WorkspaceBlock *workspace_grow(Workspace *ws, size_t size) {
+    WorkspaceBlock *block = (WorkspaceBlock*)malloc(sizeof(WorkspaceBlock));
+
+    if (block == NULL) {
+        printf("ERROR in allocating memory. Could not allocate a workspace block\n");
+        return NULL;
+    }
+    block->size = workspace_round(size);
+    block->used = 0;
+    block->data = (unsigned char*)aligned_malloc(block->size);
+    if (block->data == NULL) {
+        free(block);
+        return NULL;
+    }
+    block->next = ws->blocks;
+    ws->blocks = block;
+    ws->capacity += block->size;
+    return block;
+}
+
+// Start an empty workspace - memory is only taken from the system when it is first needed
+void init_workspace(Workspace *ws) {
+    ws->blocks = NULL;
+    ws->used = ws->peak = ws->capacity = 0;
+}
+
+// Allocate bytes from the workspace (aligned to ARRAY_ALIGNMENT), or with aligned_malloc() if ws is NULL
+// A full block is not searched again: a new block at least twice as big is started instead
+// Returns NULL if a new block was needed and could not be allocated
+void *workspace_alloc(Workspace *ws, size_t bytes) {
+    WorkspaceBlock *block;
+    void *ptr;
+
+    if (ws == NULL) {
+        return aligned_malloc(bytes);
+    }
+
+    bytes = workspace_round(bytes);
+    block = ws->blocks;
+    if (block == NULL || block->size - block->used < bytes) {
+        size_t size = block == NULL ? WORKSPACE_MIN_BLOCK : 2 * block->size;
+        block = workspace_grow(ws, size > bytes ? size : bytes);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    ptr = block->data + block->used;
+    block->used += bytes;
+    ws->used += bytes;
+    if (ws->used > ws->peak) {
+        ws->peak = ws->used;
+    }
+    return ptr;
+}
+
+// Allocate count * size zeroed bytes from the workspace, or with aligned_calloc() if ws is NULL
+void *workspace_calloc(Workspace *ws, size_t count, size_t size) {
+    void *ptr;
+
+    if (ws == NULL) {
+        return aligned_calloc(count, size);
+    }
+    ptr = workspace_alloc(ws, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+// Free memory from workspace_alloc() - only does anything if ws is NULL, workspaces free everything on reset
+void workspace_free(Workspace *ws, void *ptr) {
+    if (ws == NULL) {
+        free(ptr);
+    }
+}
+
+// Remember the current position of the workspace, to release the temporaries allocated after it
+WorkspaceMark workspace_mark(Workspace *ws) {
+    WorkspaceMark mark = {NULL, 0, 0};
+
+    if (ws != NULL) {
+        mark.block = ws->blocks;
+        mark.block_used = ws->blocks != NULL ? ws->blocks->used : 0;
+        mark.used = ws->used;
+    }
+    return mark;
+}
+
+// Roll the workspace back to mark, releasing everything allocated since - nothing to do if ws is NULL
+void workspace_release(Workspace *ws, WorkspaceMark mark) {
+    WorkspaceBlock *block;
+
+    if (ws == NULL) {
+        return;
+    }
+
+    // Blocks started after the mark only hold released memory
+    while (ws->blocks != mark.block) {
+        block = ws->blocks;
+        ws->blocks = block->next;
+        ws->capacity -= block->size;
+        free(block->data);
+        free(block);
+    }
+    if (ws->blocks != NULL) {
+        ws->blocks->used = mark.block_used;
+    }
+    ws->used = mark.used;
+}
+
+// Release everything allocated from the workspace, keeping its memory for the next fit
+// If the last fit needed more than one block, or blocks since released, they are replaced by one
+// that holds the peak, so a fit no bigger than the last allocates nothing
+void workspace_reset(Workspace *ws) {
+    size_t capacity = ws->capacity;
+
+    if (ws->blocks != NULL && (ws->blocks->next != NULL || ws->blocks->size < ws->peak)) {
+        free_workspace(ws);
+        workspace_grow(ws, capacity > ws->peak ? capacity : ws->peak);
+    }
+    if (ws->blocks != NULL) {
+        ws->blocks->used = 0;
+    }
+    ws->used = 0;
+}
+
+// Return all the memory of the workspace to the system (the peak is kept)
+void free_workspace(Workspace *ws) {
+    WorkspaceBlock *block;
+
+    while (ws->blocks != NULL) {
+        block = ws->blocks;
+        ws->blocks = block->next;
+        free(block->data);
+        free(block);
+    }
+    ws->used = ws->capacity = 0;
+}
+
+// VIEWS ------
+
+// The n x m block of X starting at entry (row, col), sharing X's memory
+Matrix matrix_view(Matrix X, size_t row, size_t col, size_t n, size_t m) {
+    Matrix view;
+    view.n = n;
+    view.m = m;
+    view.ld = X.ld;
+    view.data = X.data + (size_t)row * X.ld + col;
+    return view;
+}
+
+// Row i of X as a (contiguous) vector sharing X's memory
+Vector row_view(Matrix X, size_t i) {
+    Vector view;
+    view.size = X.m;
+    view.stride = 1;
+    view.data = X.data + (size_t)i * X.ld;
+    return view;
+}
+
+// Column j of X as a vector with stride ld sharing X's memory
+Vector column_view(Matrix X, size_t j) {
+    Vector view;
+    view.size = X.n;
+    view.stride = X.ld;
+    view.data = X.data + j;
+    return view;
+}
+
+// The size entries of x starting at entry start, sharing x's memory
+Vector vector_view(Vector x, size_t start, size_t size) {
+    Vector view;
+    view.size = size;
+    view.stride = x.stride;
+    view.data = x.data + (size_t)start * x.stride;
+    return view;
+}
+
+// Returns whether the rows of X follow each other in memory with no gaps (1) or not (0)
+int is_contiguous_matrix(Matrix X) {
+    return X.ld == X.m || X.n <= 1;
+}
+
+// MATRIX AND VECTOR OPERATIONS ------
 
 // Returns whether the matrix X is upper triangular (1) or not (0)
 int is_upper_triangular(Matrix *X) {
-    int i, j;
+    size_t i, j;
     for (i = 0; i < X->n; i++) {
         for (j = 0; j < i; j++) {
-            if (X->data[i*X->m + j] != 0.0f) {
+            if (X->data[i*X->ld + j] != 0.0f) {
                 return 0;
             }
         }
@@ -18,16 +252,16 @@ int is_upper_triangular(Matrix *X) {
 }
 
 // Transpose a matrix 
-Matrix transpose_matrix(Matrix X) {
-    Matrix X_T; int i, j;
+Matrix transpose_matrix(Workspace *ws, Matrix X) {
+    Matrix X_T; size_t i, j;
 
-    X_T.n = X.m; X_T.m = X.n;
-    X_T.data = (double*)malloc(X_T.n * X_T.m * sizeof(double));
+    X_T.n = X.m; X_T.m = X_T.ld = X.n;
+    X_T.data = (double*)workspace_alloc(ws, X_T.n * X_T.m * sizeof(double));
 
     // data[i][j] = data[j][i]
     for (i = 0; i < X.n; i++) {
         for (j = 0; j < X.m; j++) {
-            X_T.data[j * X_T.m + i] = X.data[i * X.m + j];
+            X_T.data[j * X_T.ld + i] = X.data[i * X.ld + j];
         }
     }
 
@@ -35,22 +269,23 @@ Matrix transpose_matrix(Matrix X) {
 }
 
 // Invert the 2x2 matrix provided
-Matrix invert_matrix_2by2(Matrix X) {
+Matrix invert_matrix_2by2(Workspace *ws, Matrix X) {
     Matrix X_inverse;
     double a, b, c, d, determinant;
     X_inverse.n = 2;
     X_inverse.m = 2;
-    X_inverse.data = (double*)malloc(4 * sizeof(double));
+    X_inverse.ld = 2;
+    X_inverse.data = (double*)workspace_alloc(ws, 4 * sizeof(double));
 
     if (X.n != 2 || X.m != 2) {
-        printf("ERROR in inverting 2x2 matrix. Dimensions of matrix X to invert are not 2x2 but are %dx%d\n", X.n, X.m);
+        printf("ERROR in inverting 2x2 matrix. Dimensions of matrix X to invert are not 2x2 but are %zux%zu\n", X.n, X.m);
         return X_inverse;
     }
 
     a = X.data[0];
     b = X.data[1];
-    c = X.data[2];
-    d = X.data[3];
+    c = X.data[X.ld];
+    d = X.data[X.ld + 1];
     determinant = a*d - b*c;
 
     if (determinant == 0.0f) {
@@ -70,41 +305,31 @@ Matrix invert_matrix_2by2(Matrix X) {
 }
 
 // Calculate X*Y = Z
-Matrix multiply_matrix_matrix(Matrix X, Matrix Y) {
-    Matrix Z; int i, j, k; double res;
-    Z.n = X.n; Z.m = Y.m;
-    Z.data = (double*)malloc(Z.n * Z.m * sizeof(double));
+// Cache-blocked and register-tiled, with the SIMD microkernel picked at runtime (see simd.c)
+Matrix multiply_matrix_matrix(Workspace *ws, Matrix X, Matrix Y) {
+    Matrix Z;
+    Z.n = X.n; Z.m = Z.ld = Y.m;
+    Z.data = (double*)workspace_alloc(ws, Z.n * Z.m * sizeof(double));
 
     if (X.m != Y.n) {
-        printf("ERROR in matrix-matrix multiplication: Dimensions do not match. Trying to multiply matrix X of dimensions %dx%d, with matrix Y of dimensions %dx%d\n", X.n, X.m, Y.n, Y.m);
+        printf("ERROR in matrix-matrix multiplication: Dimensions do not match. Trying to multiply matrix X of dimensions %zux%zu, with matrix Y of dimensions %zux%zu\n", X.n, X.m, Y.n, Y.m);
         return Z;
     }
 
-    for (i = 0; i < Z.n; i++) {
-        for (j = 0; j < Z.m; j++) {
-            // multiply row i of X by column j of Y
+    gemm(simd_level(), X.n, Y.m, X.m, X.data, X.ld, Y.data, Y.ld, Z.data, Z.ld);
 
-            res = 0;
-            for (k = 0; k < X.m; k++) {
-                // printf("%lf*%lf = %lf\n", X.data[i * X.m + k], Y.data[k * Y.m + j], X.data[i * X.m + k] * Y.data[k * Y.m + j]);
-                res += X.data[i * X.m + k] * Y.data[k * Y.m + j];
-            }
-            // printf("(%d,%d): %lf\n\n", i, j, res);
-            Z.data[i * Z.m + j] = res;
-        }
-    }
-    
     return Z;
 }
 
 // Calculate X*y = z
-Vector multiply_matrix_vector(Matrix X, Vector y) {
-    Vector z; int i, j; double res;
+Vector multiply_matrix_vector(Workspace *ws, Matrix X, Vector y) {
+    Vector z; size_t i, j; double res;
     z.size = X.n;
-    z.data = (double*)malloc(sizeof(double) * X.n);
+    z.stride = 1;
+    z.data = (double*)workspace_alloc(ws, sizeof(double) * X.n);
 
     if (X.m != y.size) {
-        printf("ERROR in matrix vector multiplication. Dimensions do not match. Trying to multiply %dx%d matrix X with %dx1 vector y\n", X.n, X.m, y.size);
+        printf("ERROR in matrix vector multiplication. Dimensions do not match. Trying to multiply %zux%zu matrix X with %zux1 vector y\n", X.n, X.m, y.size);
     }
 
     for (i = 0; i < z.size; i++) {
@@ -112,8 +337,8 @@ Vector multiply_matrix_vector(Matrix X, Vector y) {
 
         res = 0;
         for (j = 0; j < y.size; j++) {
-            // printf("%lf, %lf\n", X.data[i*X.m + j], y.data[j]);
-            res += X.data[i * X.m + j] * y.data[j];
+            // printf("%lf, %lf\n", X.data[i*X.ld + j], y.data[j*y.stride]);
+            res += X.data[i * X.ld + j] * y.data[j * y.stride];
         }
 
         z.data[i] = res;
@@ -122,63 +347,182 @@ Vector multiply_matrix_vector(Matrix X, Vector y) {
     return z;
 }
 
+// Calculate X_T*Y = Z without forming X_T
+// Z is the sum over rows r of the outer products x_r_T * y_r, so X and Y are both walked along their rows
+Matrix multiply_transpose_matrix_matrix(Workspace *ws, Matrix X, Matrix Y) {
+    Matrix Z; size_t r, i, j;
+    Z.n = X.m; Z.m = Z.ld = Y.m;
+    Z.data = (double*)workspace_calloc(ws, Z.n * Z.m, sizeof(double));
+
+    if (X.n != Y.n) {
+        printf("ERROR in transposed matrix-matrix multiplication: Dimensions do not match. Trying to multiply the transpose of matrix X of dimensions %zux%zu, with matrix Y of dimensions %zux%zu\n", X.n, X.m, Y.n, Y.m);
+        return Z;
+    }
+
+    for (r = 0; r < X.n; r++) {
+        const double *x_r = X.data + (size_t)r * X.ld;
+        const double *y_r = Y.data + (size_t)r * Y.ld;
+        for (i = 0; i < X.m; i++) {
+            double x_ri = x_r[i];
+            double *z_i = Z.data + i * Z.ld;
+            for (j = 0; j < Y.m; j++) {
+                z_i[j] += x_ri * y_r[j];
+            }
+        }
+    }
+
+    return Z;
+}
+
+// Calculate X_T*X = Z (symmetric rank-k update) without forming X_T
+// Only the upper triangle is accumulated, which halves the work, and it is mirrored at the end
+Matrix multiply_transpose_matrix_self(Workspace *ws, Matrix X) {
+    Matrix Z; size_t r, i, j;
+    Z.n = Z.m = Z.ld = X.m;
+    Z.data = (double*)workspace_calloc(ws, Z.n * Z.m, sizeof(double));
+
+    // Four rows at a time so each entry of Z is loaded and stored once per four updates
+    for (r = 0; r + 4 <= X.n; r += 4) {
+        const double *x_0 = X.data + (size_t)r * X.ld, *x_1 = x_0 + X.ld, *x_2 = x_1 + X.ld, *x_3 = x_2 + X.ld;
+        for (i = 0; i < X.m; i++) {
+            double a_0 = x_0[i], a_1 = x_1[i], a_2 = x_2[i], a_3 = x_3[i];
+            double *z_i = Z.data + i * Z.ld;
+            for (j = i; j < X.m; j++) {
+                z_i[j] += a_0 * x_0[j] + a_1 * x_1[j] + a_2 * x_2[j] + a_3 * x_3[j];
+            }
+        }
+    }
+    for (; r < X.n; r++) {
+        const double *x_r = X.data + (size_t)r * X.ld;
+        for (i = 0; i < X.m; i++) {
+            double x_ri = x_r[i];
+            double *z_i = Z.data + i * Z.ld;
+            for (j = i; j < X.m; j++) {
+                z_i[j] += x_ri * x_r[j];
+            }
+        }
+    }
+
+    for (i = 0; i < Z.n; i++) {
+        for (j = 0; j < i; j++) {
+            Z.data[i * Z.ld + j] = Z.data[j * Z.ld + i];
+        }
+    }
+
+    return Z;
+}
+
+// Calculate X_T*y = z without forming X_T
+Vector multiply_transpose_matrix_vector(Workspace *ws, Matrix X, Vector y) {
+    Vector z; size_t r, i;
+    z.size = X.m;
+    z.stride = 1;
+    z.data = (double*)workspace_calloc(ws, z.size, sizeof(double));
+
+    if (X.n != y.size) {
+        printf("ERROR in transposed matrix vector multiplication. Dimensions do not match. Trying to multiply the transpose of %zux%zu matrix X with %zux1 vector y\n", X.n, X.m, y.size);
+        return z;
+    }
+
+    for (r = 0; r < X.n; r++) {
+        const double *x_r = X.data + (size_t)r * X.ld;
+        double y_r = y.data[(size_t)r * y.stride];
+        for (i = 0; i < X.m; i++) {
+            z.data[i] += x_r[i] * y_r;
+        }
+    }
+
+    return z;
+}
+
 // res = x_T * y
+// Contiguous vectors go to the SIMD kernel, strided views are walked entry by entry
 double multiply_vector_vector(Vector x, Vector y) {
     double res = 0.0f;
-    int i;
+    size_t i;
 
     if (x.size != y.size) {
-        printf("ERROR in dot product of 2 vectors. Dimensions of vector x is %dx1 and of vector y is %dx1\n", x.size, y.size);
+        printf("ERROR in dot product of 2 vectors. Dimensions of vector x is %zux1 and of vector y is %zux1\n", x.size, y.size);
         return 0.0f;
     }
 
+    if (x.stride == 1 && y.stride == 1) {
+        return blas_dot(simd_level(), x.size, x.data, y.data);
+    }
     for (i = 0; i < x.size; i++) {
-        res += x.data[i] * y.data[i];
+        res += x.data[(size_t)i * x.stride] * y.data[(size_t)i * y.stride];
     }
 
     return res;
 }
 
-// Return column i of matrix X
-Vector get_column(Matrix X, int i) {
+// Return a contiguous copy of column i of matrix X (column_view() looks at it without copying)
+Vector get_column(Workspace *ws, Matrix X, size_t i) {
     Vector res;
-    int j;
+    size_t j;
     res.size = X.n;
-    res.data = (double*)malloc(res.size * sizeof(double));
+    res.stride = 1;
+    res.data = (double*)workspace_alloc(ws, res.size * sizeof(double));
     
     for (j = 0; j < X.n; j++) {
-        res.data[j] = X.data[j * X.m + i];
+        res.data[j] = X.data[j * X.ld + i];
     }
 
     return res;
 }
 
-// Return the magnitude of vector x
+// Return the magnitude of vector x (rescaled internally so it cannot overflow or underflow)
 double get_magnitude(Vector x) {
-    int i;
-    double mag = 0.0f;
+    double sum, scale = 0.0, ratio;
+    size_t i;
 
-    for (i = 0; i < x.size; i++) {
-        mag += x.data[i] * x.data[i];
+    if (x.stride == 1) {
+        return blas_nrm2(simd_level(), x.size, x.data);
     }
-    mag = pow(mag, 1.0 / 2.0);
 
-    return mag;
+    // Same as blas_nrm2: rescale by the largest entry only if the plain sum of squares is out of range
+    sum = multiply_vector_vector(x, x);
+    if (sum < BLAS_NRM2_SAFE_MAX && sum > BLAS_NRM2_SAFE_MIN) {
+        return sqrt(sum);
+    }
+    for (i = 0; i < x.size; i++) {
+        scale = fmax(scale, fabs(x.data[(size_t)i * x.stride]));
+    }
+    if (scale == 0.0 || isinf(scale) || isnan(sum)) {
+        return isnan(sum) ? sum : scale;
+    }
+    sum = 0.0;
+    for (i = 0; i < x.size; i++) {
+        ratio = x.data[(size_t)i * x.stride] / scale;
+        sum += ratio * ratio;
+    }
+    return scale * sqrt(sum);
 }
 
 // I will only use these functionalities in place and so the following sometimes take pass by reference (pointer) fields
 
 // x = x - y
 void subtract_vector_vector_inplace(Vector *x, Vector y) {
-    int i;
+    subtract_scaled_vector_inplace(x, 1.0, y);
+
+    return;
+}
+
+// x = x - r * y
+void subtract_scaled_vector_inplace(Vector *x, double scalar, Vector y) {
+    size_t i;
 
     if (x->size != y.size) {
-        printf("ERROR in subtracting 2 vectors. Dimensions of vector x is %dx1 and of vector y is %dx1\n", x->size, y.size);
+        printf("ERROR in subtracting 2 vectors. Dimensions of vector x is %zux1 and of vector y is %zux1\n", x->size, y.size);
         return;
     }
 
+    if (x->stride == 1 && y.stride == 1) {
+        blas_axpy(simd_level(), x->size, -scalar, y.data, x->data);
+        return;
+    }
     for (i = 0; i < x->size; i++) {
-        x->data[i] -= y.data[i];
+        x->data[(size_t)i * x->stride] -= scalar * y.data[(size_t)i * y.stride];
     }
 
     return;
@@ -186,47 +530,178 @@ void subtract_vector_vector_inplace(Vector *x, Vector y) {
 
 // x = r * x
 void multiply_scalar_vector_inplace(double scalar, Vector *x) {
-    int i;
+    size_t i;
 
+    if (x->stride == 1) {
+        blas_scal(simd_level(), x->size, scalar, x->data);
+        return;
+    }
     for (i = 0; i < x->size; i++) {
-        x->data[i] *= scalar;
+        x->data[(size_t)i * x->stride] *= scalar;
     }
 
     return;
 }
 
 // X_i = col where i = col_idx
-void copy_column_to_matrix_inplace(Vector col, Matrix *X, int col_idx) {
-    int i;
+void copy_column_to_matrix_inplace(Vector col, Matrix *X, size_t col_idx) {
+    size_t i;
 
     if (col.size != X->n) {
-        printf("ERROR in inserting column into matrix. Dimensions of vector is %dx1 and of destination matrix is %dx%d\n", col.size, X->n, X->m);
+        printf("ERROR in inserting column into matrix. Dimensions of vector is %zux1 and of destination matrix is %zux%zu\n", col.size, X->n, X->m);
         return;
     }
 
     for (i = 0; i < col.size; i++) {
-        X->data[i * X->m + col_idx] = col.data[i];
+        X->data[i * X->ld + col_idx] = col.data[i * col.stride];
     }
 
     return;
 }
 
+// FIXED-SIZE KERNELS ------
+
+/* Most regressions have only a handful of coefficients, so for p = SMALL_P_MIN..SMALL_P_MAX the least squares
+   kernels are compiled once per p. The bodies below take p as an always inlined argument; each instance passes a
+   constant, so every loop over p has a fixed trip count, is fully unrolled, and the pxp state is kept in
+   registers (spilling only for the largest p). SMALL_P_INSTANCES lists the instances and must match the range.
+*/
+#define SMALL_P_INSTANCES(F) F(2) F(3) F(4) F(5) F(6) F(7) F(8)
+
+// Rotate the row [a | b] into the upper triangular R (p x p, row-major) and z with p Givens rotations,
+// zeroing a one entry at a time: R and z are updated to the QR factorisation of the rows seen so far
+__attribute__((always_inline))
+static inline void givens_row_update(const int p, double *R, double *z, double *a, double b) {
+    double r_kk, c, s, t, inv;
+    int k, j;
+
+#pragma GCC unroll 8
+    for (k = 0; k < p; k++) {
+        if (a[k] == 0.0) {
+            continue;
+        }
+        r_kk = sqrt(R[k * p + k] * R[k * p + k] + a[k] * a[k]);
+        inv = 1.0 / r_kk;
+        c = R[k * p + k] * inv;
+        s = a[k] * inv;
+        R[k * p + k] = r_kk;
+#pragma GCC unroll 8
+        for (j = k + 1; j < p; j++) {
+            t = R[k * p + j];
+            R[k * p + j] = c * t + s * a[j];
+            a[j] = c * a[j] - s * t;
+        }
+        t = z[k];
+        z[k] = c * t + s * b;
+        b = c * b - s * t;
+    }
+}
+
+// R, z = QR factorisation of the n rows of [X | y], streamed once in row order
+__attribute__((always_inline))
+static inline void givens_rows(const int p, const double *X, size_t ld, const double *y, ptrdiff_t stride,
+                               size_t n, double *R_out, double *z_out) {
+    double R[SMALL_P_MAX * SMALL_P_MAX] = {0.0}, z[SMALL_P_MAX] = {0.0}, a[SMALL_P_MAX];
+    size_t r;
+    int j;
+
+    for (r = 0; r < n; r++) {
+#pragma GCC unroll 8
+        for (j = 0; j < p; j++) {
+            a[j] = X[r * ld + j];
+        }
+        givens_row_update(p, R, z, a, y[(ptrdiff_t)r * stride]);
+    }
+
+    memcpy(R_out, R, (size_t)p * p * sizeof(double));
+    memcpy(z_out, z, (size_t)p * sizeof(double));
+}
+
+// Solve R * x = z for upper triangular R (row stride ld) with a non-zero diagonal
+__attribute__((always_inline))
+static inline void back_sub_fixed(const int p, const double *R, size_t ld, const double *z, ptrdiff_t stride, double *x) {
+    double res;
+    int i, j;
+
+#pragma GCC unroll 8
+    for (i = p - 1; i >= 0; i--) {
+        res = z[i * stride];
+#pragma GCC unroll 8
+        for (j = i + 1; j < p; j++) {
+            res -= R[i * ld + j] * x[j];
+        }
+        x[i] = res / R[i * ld + i];
+    }
+}
+
+#define DEFINE_SMALL_P_KERNELS(P) \
+static void givens_rows_##P(const double *X, size_t ld, const double *y, ptrdiff_t stride, size_t n, double *R, double *z) { \
+    givens_rows(P, X, ld, y, stride, n, R, z); \
+} \
+static void back_sub_##P(const double *R, size_t ld, const double *z, ptrdiff_t stride, double *x) { \
+    back_sub_fixed(P, R, ld, z, stride, x); \
+}
+SMALL_P_INSTANCES(DEFINE_SMALL_P_KERNELS)
+
+// Solve R * x = z with the fixed-size kernel for R's size, returns 0 if there is none
+static int back_sub_small(Matrix R, Vector z, double *x) {
+    switch (R.n) {
+#define BACK_SUB_CASE(P) case P: back_sub_##P(R.data, R.ld, z.data, z.stride, x); return 1;
+        SMALL_P_INSTANCES(BACK_SUB_CASE)
+#undef BACK_SUB_CASE
+        default: return 0;
+    }
+}
+
+// Givens QR of X for SMALL_P_MIN to SMALL_P_MAX columns, applying the rotations to y as it goes like
+// QR_factorise_householder: returns the pxp upper triangular R and sets Q_Ty so that R * b = Q_T * y.
+// The rows are streamed once with R and Q_T * y held in registers, so unlike Householder nothing the size of X is
+// copied. Any other number of columns is passed on to QR_factorise_householder.
+Matrix QR_factorise_givens(Workspace *ws, Matrix X, Vector y, Vector *Q_Ty) {
+    Matrix R;
+    size_t p = X.m;
+
+    if (p < SMALL_P_MIN || p > SMALL_P_MAX) {
+        return QR_factorise_householder(ws, X, y, Q_Ty);
+    }
+
+    R.n = R.m = R.ld = p;
+    R.data = (double*)workspace_calloc(ws, p * p, sizeof(double));
+    Q_Ty->size = p;
+    Q_Ty->stride = 1;
+    Q_Ty->data = (double*)workspace_calloc(ws, p, sizeof(double));
+
+    if (X.n < p || y.size != X.n) {
+        printf("ERROR in Givens QR factorisation. Needs at least as many rows as columns and a matching y, but X is %zux%zu and y is %zux1\n", X.n, X.m, y.size);
+        return R;
+    }
+
+    switch (p) {
+#define GIVENS_ROWS_CASE(P) case P: givens_rows_##P(X.data, X.ld, y.data, y.stride, X.n, R.data, Q_Ty->data); break;
+        SMALL_P_INSTANCES(GIVENS_ROWS_CASE)
+#undef GIVENS_ROWS_CASE
+    }
+
+    return R;
+}
+
 // ADVANCED TECHNIQUES ------
 
 // Solve upper triangular system via back substitution: UT * x = y
-Vector solve_back_sub(Matrix UT, Vector y)  {
-    Vector x; int i,j;
+Vector solve_back_sub(Workspace *ws, Matrix UT, Vector y)  {
+    Vector x; ptrdiff_t i,j;
     x.size = UT.m;
-    x.data = (double*)malloc(sizeof(double)*x.size);
+    x.stride = 1;
+    x.data = (double*)workspace_alloc(ws, sizeof(double)*x.size);
 
     // Input validation
     if (UT.n != UT.m) {
-        printf("ERROR in solving upper-triangular system UT*x = y. Dimensions of matrix UT is %dx%d, and it should be square for a consistent system.\n", UT.n, UT.m);
+        printf("ERROR in solving upper-triangular system UT*x = y. Dimensions of matrix UT is %zux%zu, and it should be square for a consistent system.\n", UT.n, UT.m);
         return x;
     }
 
     if (UT.n != y.size) {
-        printf("ERROR in solving upper-triangular system UT*x = y. Dimensions of matrix UT is %dx%d and of vector y is %dx1\n", UT.n, UT.m, y.size);
+        printf("ERROR in solving upper-triangular system UT*x = y. Dimensions of matrix UT is %zux%zu and of vector y is %zux1\n", UT.n, UT.m, y.size);
         return x;
     }
 
@@ -235,10 +710,16 @@ Vector solve_back_sub(Matrix UT, Vector y)  {
         return x;
     }
 
+    // Small systems with a non-zero diagonal go to the unrolled kernel for their size
+    for (i = 0; i < (ptrdiff_t)UT.n && UT.data[i * UT.ld + i] != 0.0; i++);
+    if (i == (ptrdiff_t)UT.n && back_sub_small(UT, y, x.data)) {
+        return x;
+    }
+
     // Back substitution
-    for (i = x.size - 1; i >= 0; i--) {
-        double coeff = UT.data[i * UT.m + i];
-        double res = y.data[i];
+    for (i = (ptrdiff_t)x.size - 1; i >= 0; i--) {
+        double coeff = UT.data[i * UT.ld + i];
+        double res = y.data[i * y.stride];
 
         // Avoid division by 0 error
         if (coeff == 0.0f) {
@@ -247,8 +728,8 @@ Vector solve_back_sub(Matrix UT, Vector y)  {
         }
         
         // Substitute discovered values
-        for (j = UT.m-1; j > i; j--) {
-            res -= UT.data[i * UT.m + j] * x.data[j];
+        for (j = (ptrdiff_t)UT.m-1; j > i; j--) {
+            res -= UT.data[i * UT.ld + j] * x.data[j];
         }
         res /= coeff;
         x.data[i] = res;
@@ -258,62 +739,614 @@ Vector solve_back_sub(Matrix UT, Vector y)  {
 }
 
 // QR factorisation via Classical Gram-Schmidt
-QR QR_factorise(Matrix X) {
+// Each new column is projected against all the previous ones at once, r = Q_prev_T * X_i and Q_i = X_i - Q_prev * r,
+// where Q_prev is a view of the first i columns of Q. Both products walk along rows of Q, and the columns of X and
+// Q are read and written in place through views, so no column is copied out.
+QR QR_factorise(Workspace *ws, Matrix X) {
     QR res;
-    double magnitude;
 
     res.Q.n = X.n;
-    res.Q.m = X.m;
+    res.Q.m = res.Q.ld = X.m;
     res.R.n = X.m;
-    res.R.m = X.m;
-    res.Q.data = (double*)malloc(res.Q.n*res.Q.m*sizeof(double));
-    res.R.data = (double*)malloc(res.R.n*res.R.m*sizeof(double));
+    res.R.m = res.R.ld = X.m;
+    res.Q.data = (double*)workspace_alloc(ws, res.Q.n*res.Q.m*sizeof(double));
+    res.R.data = (double*)workspace_calloc(ws, res.R.n*res.R.m, sizeof(double)); // zeroed so R is upper triangular
 
-    // printf("%d x %d, %d x %d", res.Q.n, res.Q.m, res.R.n, res.R.m);
+    // printf("%zu x %zu, %zu x %zu", res.Q.n, res.Q.m, res.R.n, res.R.m);
 
-    int i, j;
+    size_t i;
 
     // loop over the columns of X
     for (i = 0; i < X.m; i++) {
         // generate corresponding orthonormal column of Q and necessary entries in R
-        Vector X_i = get_column(X, i);
-        Vector Q_i = get_column(X, i); // Q_i = X_i
-
-        for (j = 0; j < i; j++) {
-            Vector Q_j = get_column(res.Q, j);
-            // r_ji = Q_j • X_i
-            double r_ji = multiply_vector_vector(Q_j, X_i);
-            // save r_ji to matrix R
-            res.R.data[j*res.R.m + i] = r_ji;
-
-            // Q_i = Q_i - r_ji * Q_j
-            multiply_scalar_vector_inplace(r_ji, &Q_j);
-            subtract_vector_vector_inplace(&Q_i, Q_j);
+        Vector X_i = column_view(X, i);
+        Vector Q_i = column_view(res.Q, i);
+        copy_column_to_matrix_inplace(X_i, &res.Q, i); // Q_i = X_i
+
+        if (i > 0) {
+            // the products are temporaries, released again at the end of each iteration
+            WorkspaceMark mark = workspace_mark(ws);
+            Matrix Q_prev = matrix_view(res.Q, 0, 0, X.n, i);
+            Matrix R_prev = matrix_view(res.R, 0, 0, i, X.m);
+
+            // r_ji = Q_j • X_i for every j < i, saved to column i of R
+            Vector r_i = multiply_transpose_matrix_vector(ws, Q_prev, X_i);
+            copy_column_to_matrix_inplace(r_i, &R_prev, i);
+
+            // Q_i = Q_i - sum_j r_ji * Q_j
+            Vector projection = multiply_matrix_vector(ws, Q_prev, r_i);
+            subtract_vector_vector_inplace(&Q_i, projection);
+            workspace_free(ws, r_i.data);
+            workspace_free(ws, projection.data);
+            workspace_release(ws, mark);
         }
 
         // Q_i = Q_i / |Q_i|
         // r_ii = |Q_i|
         double r_ii = get_magnitude(Q_i);
         // save r_ii to matrix R
-        res.R.data[i*res.R.m + i] = r_ii;
+        res.R.data[i*res.R.ld + i] = r_ii;
 
         multiply_scalar_vector_inplace(1/r_ii, &Q_i);
-        // Move Q_i back into the corresponding column of the Q matrix 
-        copy_column_to_matrix_inplace(Q_i, &res.Q, i);
     }
 
     return res;
 }
 
+// QR factorisation via Modified Gram-Schmidt
+// X is copied once into a column-major workspace so every column is contiguous, and the columns
+// are orthogonalised in place against each new q_i as soon as it is found (more stable than
+// classical Gram-Schmidt). There are no allocations inside the loops.
+QR QR_factorise_mgs(Workspace *ws, Matrix X) {
+    QR res;
+    WorkspaceMark mark;
+    double *W, *q_i, *w_j, r_ii, r_ij;
+    SimdLevel level = simd_level();
+    size_t i, j, k;
+
+    res.Q.n = X.n;
+    res.Q.m = res.Q.ld = X.m;
+    res.R.n = X.m;
+    res.R.m = res.R.ld = X.m;
+    res.Q.data = (double*)workspace_alloc(ws, res.Q.n*res.Q.m*sizeof(double));
+    res.R.data = (double*)workspace_calloc(ws, res.R.n*res.R.m, sizeof(double));
+
+    // W[j*n + k] = X[k][j]
+    mark = workspace_mark(ws);
+    W = (double*)workspace_alloc(ws, X.n*X.m*sizeof(double));
+    for (k = 0; k < X.n; k++) {
+        for (j = 0; j < X.m; j++) {
+            W[j * X.n + k] = X.data[k * X.ld + j];
+        }
+    }
+
+    for (i = 0; i < X.m; i++) {
+        q_i = W + (size_t)i * X.n;
+
+        // r_ii = |w_i|, q_i = w_i / r_ii
+        r_ii = blas_nrm2(level, X.n, q_i);
+        res.R.data[i*res.R.ld + i] = r_ii;
+
+        if (r_ii == 0.0) {
+            // column i is dependent on the previous ones - leave q_i as 0 and let back substitution report it
+            continue;
+        }
+        blas_scal(level, X.n, 1.0 / r_ii, q_i);
+
+        // Remove the q_i component from every remaining column: r_ij = q_i • w_j, w_j = w_j - r_ij * q_i
+        for (j = i + 1; j < X.m; j++) {
+            w_j = W + (size_t)j * X.n;
+            r_ij = blas_dot(level, X.n, q_i, w_j);
+            res.R.data[i*res.R.ld + j] = r_ij;
+            blas_axpy(level, X.n, -r_ij, q_i, w_j);
+        }
+    }
+
+    // Move the orthonormal columns back into the row-major Q
+    for (k = 0; k < X.n; k++) {
+        for (j = 0; j < X.m; j++) {
+            res.Q.data[k * res.Q.ld + j] = W[j * X.n + k];
+        }
+    }
+
+    workspace_free(ws, W);
+    workspace_release(ws, mark);
+    return res;
+}
+
+// Form the Householder reflector H = I - tau * v * v_T mapping x (of length len) onto beta * e_1
+// v[0] = 1 is implicit: x[1:] is overwritten by v[1:] and x[0] by beta. Returns tau (0 when H = I)
+static double make_householder(double *x, size_t len, SimdLevel level) {
+    double alpha = x[0], norm, beta;
+
+    norm = blas_nrm2(level, len - 1, x + 1);
+    if (norm == 0.0) {
+        return 0.0;
+    }
+
+    // choose the sign of beta opposite to alpha to avoid cancellation in alpha - beta
+    norm = hypot(alpha, norm);
+    beta = alpha >= 0.0 ? -norm : norm;
+    blas_scal(level, len - 1, 1.0 / (alpha - beta), x + 1);
+    x[0] = beta;
+
+    return (beta - alpha) / beta;
+}
+
+// c = H * c for the reflector with vector v (implicit leading 1) over len entries
+static void apply_householder(const double *v, double tau, double *c, size_t len, SimdLevel level) {
+    double w;
+
+    if (tau == 0.0) {
+        return;
+    }
+    w = tau * (c[0] + blas_dot(level, len - 1, v + 1, c + 1));
+    c[0] -= w;
+    blas_axpy(level, len - 1, -w, v + 1, c + 1);
+}
+
+// Apply Q_T = (I - V*T*V_T)_T = I - V*T_T*V_T of a panel of b reflectors to the trailing columns of the workspace
+// V holds the reflectors in columns k0..k0+b-1 (unit diagonal implicit), and the trailing columns are k0+b..cols-1.
+// The rows are processed in chunks so each chunk of V and of the trailing columns is read from memory once per pass.
+static void apply_block_reflector(double *A, size_t n, size_t cols, size_t k0, size_t b, const double *T, double *W) {
+    size_t nc, i, j, l, r, r0, r1;
+    const double *v;
+    double *c, sum;
+
+    if (cols <= k0 + b) {
+        return;
+    }
+    nc = cols - (k0 + b);
+    memset(W, 0, (size_t)b * nc * sizeof(double));
+
+    // W = V_T * C, starting with the triangular top b rows of V
+    for (j = 0; j < nc; j++) {
+        c = A + (size_t)(k0 + b + j) * n;
+        for (i = 0; i < b; i++) {
+            v = A + (size_t)(k0 + i) * n;
+            sum = c[k0 + i];
+            for (r = k0 + i + 1; r < k0 + b; r++) {
+                sum += v[r] * c[r];
+            }
+            W[i * nc + j] = sum;
+        }
+    }
+    for (r0 = k0 + b; r0 < n; r0 += HOUSEHOLDER_ROW_CHUNK) {
+        r1 = r0 + HOUSEHOLDER_ROW_CHUNK < n ? r0 + HOUSEHOLDER_ROW_CHUNK : n;
+        for (j = 0; j < nc; j++) {
+            c = A + (size_t)(k0 + b + j) * n;
+            for (i = 0; i < b; i++) {
+                v = A + (size_t)(k0 + i) * n;
+                sum = 0.0;
+                for (r = r0; r < r1; r++) {
+                    sum += v[r] * c[r];
+                }
+                W[i * nc + j] += sum;
+            }
+        }
+    }
+
+    // W = T_T * W (T_T is lower triangular so go bottom up to do it in place)
+    for (j = 0; j < nc; j++) {
+        for (i = b; i-- > 0; ) {
+            sum = 0.0;
+            for (l = 0; l <= i; l++) {
+                sum += T[l * b + i] * W[l * nc + j];
+            }
+            W[i * nc + j] = sum;
+        }
+    }
+
+    // C = C - V * W, again starting with the triangular top rows
+    for (j = 0; j < nc; j++) {
+        c = A + (size_t)(k0 + b + j) * n;
+        for (i = 0; i < b; i++) {
+            v = A + (size_t)(k0 + i) * n;
+            c[k0 + i] -= W[i * nc + j];
+            for (r = k0 + i + 1; r < k0 + b; r++) {
+                c[r] -= v[r] * W[i * nc + j];
+            }
+        }
+    }
+    for (r0 = k0 + b; r0 < n; r0 += HOUSEHOLDER_ROW_CHUNK) {
+        r1 = r0 + HOUSEHOLDER_ROW_CHUNK < n ? r0 + HOUSEHOLDER_ROW_CHUNK : n;
+        for (j = 0; j < nc; j++) {
+            c = A + (size_t)(k0 + b + j) * n;
+            for (i = 0; i < b; i++) {
+                v = A + (size_t)(k0 + i) * n;
+                sum = W[i * nc + j];
+                for (r = r0; r < r1; r++) {
+                    c[r] -= v[r] * sum;
+                }
+            }
+        }
+    }
+}
+
+// Blocked Householder QR factorisation of X, applying the reflectors to y as they are formed so Q is never built
+// Returns the pxp upper triangular R and sets Q_Ty to the first p entries of Q_T * y, so that R * b = Q_T * y.
+// [X | y] is copied into a column-major workspace; each panel of HOUSEHOLDER_BLOCK_SIZE columns is factorised
+// column by column, then applied to the rest of the workspace (including y) at once in compact WY form.
+Matrix QR_factorise_householder(Workspace *ws, Matrix X, Vector y, Vector *Q_Ty) {
+    Matrix R;
+    WorkspaceMark mark;
+    double *A, *T, *W, *tau, *v_i, sum;
+    SimdLevel level = simd_level();
+    size_t n = X.n, p = X.m, k0, b, k, i, j, r;
+
+    R.n = R.m = R.ld = p;
+    R.data = (double*)workspace_calloc(ws, (size_t)p * p, sizeof(double));
+    Q_Ty->size = p;
+    Q_Ty->stride = 1;
+    Q_Ty->data = (double*)workspace_calloc(ws, p, sizeof(double));
+
+    if (n < p || y.size != n) {
+        printf("ERROR in Householder QR factorisation. Needs at least as many rows as columns and a matching y, but X is %zux%zu and y is %zux1\n", X.n, X.m, y.size);
+        return R;
+    }
+
+    // A = [X | y] stored column-major, and like the rest of the scratch space released before returning
+    // Each panel of reflectors is then worked on in place in A
+    mark = workspace_mark(ws);
+    A = (double*)workspace_alloc(ws, (size_t)n * (p + 1) * sizeof(double));
+    for (r = 0; r < n; r++) {
+        for (j = 0; j < p; j++) {
+            A[(size_t)j * n + r] = X.data[(size_t)r * X.ld + j];
+        }
+        A[(size_t)p * n + r] = y.data[(size_t)r * y.stride];
+    }
+
+    T = (double*)workspace_alloc(ws, HOUSEHOLDER_BLOCK_SIZE * HOUSEHOLDER_BLOCK_SIZE * sizeof(double));
+    W = (double*)workspace_alloc(ws, (size_t)HOUSEHOLDER_BLOCK_SIZE * (p + 1) * sizeof(double));
+    tau = (double*)workspace_alloc(ws, HOUSEHOLDER_BLOCK_SIZE * sizeof(double));
+
+    for (k0 = 0; k0 < p; k0 += HOUSEHOLDER_BLOCK_SIZE) {
+        b = p - k0 < HOUSEHOLDER_BLOCK_SIZE ? p - k0 : HOUSEHOLDER_BLOCK_SIZE;
+
+        // Factorise the panel one column at a time
+        for (k = k0; k < k0 + b; k++) {
+            v_i = A + (size_t)k * n + k;
+            tau[k - k0] = make_householder(v_i, n - k, level);
+            for (j = k + 1; j < k0 + b; j++) {
+                apply_householder(v_i, tau[k - k0], A + (size_t)j * n + k, n - k, level);
+            }
+        }
+
+        // T such that H_k0 * ... * H_k0+b-1 = I - V * T * V_T: T_ii = tau_i, T[0:i, i] = -tau_i * T[0:i, 0:i] * V[:, 0:i]_T * v_i
+        memset(T, 0, (size_t)b * b * sizeof(double));
+        for (i = 0; i < b; i++) {
+            v_i = A + (size_t)(k0 + i) * n;
+            for (j = 0; j < i; j++) {
+                const double *v_j = A + (size_t)(k0 + j) * n;
+                W[j] = v_j[k0 + i] + blas_dot(level, n - (k0 + i + 1), v_j + k0 + i + 1, v_i + k0 + i + 1);
+            }
+            for (j = 0; j < i; j++) {
+                sum = 0.0;
+                for (k = j; k < i; k++) {
+                    sum += T[j * b + k] * W[k];
+                }
+                T[j * b + i] = -tau[i] * sum;
+            }
+            T[i * b + i] = tau[i];
+        }
+
+        apply_block_reflector(A, n, p + 1, k0, b, T, W);
+    }
+
+    // R is the upper triangle of the first p rows, and Q_T * y the first p entries of the y column
+    for (i = 0; i < p; i++) {
+        for (j = i; j < p; j++) {
+            R.data[i * p + j] = A[(size_t)j * n + i];
+        }
+        Q_Ty->data[i] = A[(size_t)p * n + i];
+    }
+
+    workspace_free(ws, A);
+    workspace_free(ws, T);
+    workspace_free(ws, W);
+    workspace_free(ws, tau);
+    workspace_release(ws, mark);
+    return R;
+}
+
+// Struct for one QR least squares problem run on a worker thread of the TSQR
+struct TSQRTask {
+    Matrix X;
+    Vector y;
+    Matrix R;
+    Vector Q_Ty;
+};
+
+// Thread entry point: R, Q_Ty = QR_factorise_givens(X, y), malloced as a workspace cannot be shared between threads
+static void *tsqr_factorise_task(void *arg) {
+    struct TSQRTask *task = (struct TSQRTask*)arg;
+    task->R = QR_factorise_givens(NULL, task->X, task->y, &task->Q_Ty);
+    return NULL;
+}
+
+// Run the tasks on one thread each and wait for them all
+static void tsqr_run_tasks(struct TSQRTask *tasks, int count) {
+    pthread_t *threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    int *started = (int*)calloc(count, sizeof(int));
+    int i;
+
+    for (i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, tsqr_factorise_task, &tasks[i]) == 0;
+        if (!started[i]) {
+            // could not start a thread - do the work on this one instead
+            tsqr_factorise_task(&tasks[i]);
+        }
+    }
+    tsqr_factorise_task(&tasks[0]);
+    for (i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    free(threads);
+    free(started);
+}
+
+// Tall-skinny QR (TSQR) of X across num_threads threads (all online cores if num_threads <= 0)
+// X and y are split into row blocks which are factorised in parallel. Pairs of the small R factors (with their
+// Q_T*y) are then stacked and factorised again, level by level in a tree, until one R and Q_Ty remain.
+// Each block and pair is factorised with QR_factorise_givens (Householder above SMALL_P_MAX columns).
+// Returns R and sets Q_Ty like QR_factorise_householder, so that R * b = Q_T * y.
+Matrix QR_factorise_tsqr(Workspace *ws, Matrix X, Vector y, Vector *Q_Ty, int num_threads) {
+    struct TSQRTask *tasks, *pairs;
+    Matrix R;
+    size_t block_rows, r0, p = X.m;
+    int blocks, i, count;
+
+    if (num_threads <= 0) {
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // Every block needs at least p rows to have a pxp R
+    blocks = num_threads;
+    if (p > 0 && (size_t)blocks > X.n / p) {
+        blocks = (int)(X.n / p);
+    }
+    if (blocks <= 1) {
+        return QR_factorise_givens(ws, X, y, Q_Ty);
+    }
+
+    // The row blocks are views into X and y, so nothing is copied
+    tasks = (struct TSQRTask*)malloc(blocks * sizeof(struct TSQRTask));
+    block_rows = X.n / blocks;
+    for (i = 0, r0 = 0; i < blocks; i++, r0 += block_rows) {
+        size_t rows = i == blocks - 1 ? X.n - r0 : block_rows;
+        tasks[i].X = matrix_view(X, r0, 0, rows, p);
+        tasks[i].y = vector_view(y, r0, rows);
+    }
+    tsqr_run_tasks(tasks, blocks);
+
+    // Reduction tree: factorise each stacked pair [R_a; R_b], [z_a; z_b] until one remains
+    for (count = blocks; count > 1; count = (count + 1) / 2) {
+        pairs = (struct TSQRTask*)malloc((count / 2) * sizeof(struct TSQRTask));
+        for (i = 0; i < count / 2; i++) {
+            struct TSQRTask *a = &tasks[2 * i], *b = &tasks[2 * i + 1];
+            pairs[i].X.n = pairs[i].y.size = 2 * p;
+            pairs[i].X.m = pairs[i].X.ld = p;
+            pairs[i].y.stride = 1;
+            pairs[i].X.data = (double*)aligned_malloc((size_t)2 * p * p * sizeof(double));
+            pairs[i].y.data = (double*)aligned_malloc((size_t)2 * p * sizeof(double));
+            memcpy(pairs[i].X.data, a->R.data, (size_t)p * p * sizeof(double));
+            memcpy(pairs[i].X.data + (size_t)p * p, b->R.data, (size_t)p * p * sizeof(double));
+            memcpy(pairs[i].y.data, a->Q_Ty.data, p * sizeof(double));
+            memcpy(pairs[i].y.data + p, b->Q_Ty.data, p * sizeof(double));
+        }
+        tsqr_run_tasks(pairs, count / 2);
+
+        // The level's inputs are no longer needed; an odd one out moves up to the next level unchanged
+        for (i = 0; i < count / 2; i++) {
+            free(tasks[2 * i].R.data);
+            free(tasks[2 * i].Q_Ty.data);
+            free(tasks[2 * i + 1].R.data);
+            free(tasks[2 * i + 1].Q_Ty.data);
+            free(pairs[i].X.data);
+            free(pairs[i].y.data);
+            tasks[i] = pairs[i];
+        }
+        if (count % 2 == 1) {
+            tasks[count / 2] = tasks[count - 1];
+        }
+        free(pairs);
+    }
+
+    // The tree is malloced by the worker threads, so with a workspace the result is moved into it
+    R = tasks[0].R;
+    *Q_Ty = tasks[0].Q_Ty;
+    if (ws != NULL) {
+        R.data = (double*)workspace_alloc(ws, (size_t)p * p * sizeof(double));
+        Q_Ty->data = (double*)workspace_alloc(ws, p * sizeof(double));
+        memcpy(R.data, tasks[0].R.data, (size_t)p * p * sizeof(double));
+        memcpy(Q_Ty->data, tasks[0].Q_Ty.data, p * sizeof(double));
+        free(tasks[0].R.data);
+        free(tasks[0].Q_Ty.data);
+    }
+    free(tasks);
+    return R;
+}
+
+// Blocked, in-place factorisation shared by cholesky_factorise_inplace (ldlt = 0) and ldlt_factorise_inplace (ldlt = 1)
+// The columns are factorised CHOLESKY_BLOCK_SIZE at a time, left-looking: a block column first takes the update
+// from every column to its left as one matrix multiply, U = L * (L * D)_T of the block rows, and then the block
+// itself is factorised column by column. For Cholesky D is the identity.
+// The original entries are read from the upper triangle and the diagonal, which stay intact until they are used.
+static int factorise_symmetric_inplace(Matrix *A, int ldlt) {
+    double diagonal[CHOLESKY_BLOCK_SIZE], *W = NULL, *U = NULL;
+    size_t i, j, k, j0, j1, nb, n = A->n, ld = A->ld;
+    double *a = A->data, sum, pivot;
+    int success = 1;
+
+    // Only matrices with more than one block column need the update panels
+    if (n > CHOLESKY_BLOCK_SIZE) {
+        W = (double*)aligned_malloc(n * CHOLESKY_BLOCK_SIZE * sizeof(double));
+        U = (double*)aligned_malloc(n * CHOLESKY_BLOCK_SIZE * sizeof(double));
+        if (W == NULL || U == NULL) {
+            free(W);
+            free(U);
+            return 0;
+        }
+    }
+
+    for (j0 = 0; j0 < n && success; j0 = j1) {
+        j1 = j0 + CHOLESKY_BLOCK_SIZE < n ? j0 + CHOLESKY_BLOCK_SIZE : n;
+        nb = j1 - j0;
+
+        // U = L * W for rows j0 to n, where W (j0 x nb) holds (L * D)_T of the block rows
+        if (j0 > 0) {
+            for (k = 0; k < j0; k++) {
+                for (j = j0; j < j1; j++) {
+                    W[k * nb + j - j0] = a[j * ld + k] * (ldlt ? a[k * ld + k] : 1.0);
+                }
+            }
+            gemm(simd_level(), n - j0, nb, j0, a + j0 * ld, ld, W, nb, U, nb);
+        }
+
+        // A_ij - U_ij for the lower triangle of the block column
+        for (i = j0; i < n; i++) {
+            for (j = j0; j < j1 && j <= i; j++) {
+                sum = a[j * ld + i] - (j0 > 0 ? U[(i - j0) * nb + j - j0] : 0.0);
+                if (i == j) {
+                    diagonal[j - j0] = sum;
+                } else {
+                    a[i * ld + j] = sum;
+                }
+            }
+        }
+
+        // Factorise the block column, with the updates from the columns of the block
+        for (j = j0; j < j1; j++) {
+            sum = diagonal[j - j0];
+            for (k = j0; k < j; k++) {
+                sum -= a[j * ld + k] * a[j * ld + k] * (ldlt ? a[k * ld + k] : 1.0);
+            }
+
+            if (!(sum > CHOLESKY_PIVOT_TOLERANCE * a[j * ld + j])) {
+                success = 0;
+                break;
+            }
+            // Cholesky stores L_jj = sqrt(d_j) and LDL_T stores D_j = d_j, the column below is divided by either
+            pivot = ldlt ? sum : sqrt(sum);
+            a[j * ld + j] = pivot;
+
+            for (i = j + 1; i < n; i++) {
+                sum = a[i * ld + j];
+                for (k = j0; k < j; k++) {
+                    sum -= a[i * ld + k] * a[j * ld + k] * (ldlt ? a[k * ld + k] : 1.0);
+                }
+                a[i * ld + j] = sum / pivot;
+            }
+        }
+    }
+
+    free(W);
+    free(U);
+    return success;
+}
+
+// Factorise the symmetric positive definite matrix A = L * L_T in place, leaving L in the lower triangle
+// Only the upper triangle of A is read. Returns 1 on success, or 0 if a pivot falls below
+// CHOLESKY_PIVOT_TOLERANCE times its original diagonal entry (A is singular or too ill-conditioned) or if the
+// update panels could not be allocated
+int cholesky_factorise_inplace(Matrix *A) {
+    if (A->n != A->m) {
+        printf("ERROR in Cholesky factorisation. Dimensions of matrix A is %zux%zu, and it should be square.\n", A->n, A->m);
+        return 0;
+    }
+
+    return factorise_symmetric_inplace(A, 0);
+}
+
+// Factorise the symmetric positive definite matrix A = L * D * L_T in place, leaving the unit lower triangular L
+// below the diagonal and D on it. Takes no square roots, otherwise the same as cholesky_factorise_inplace
+int ldlt_factorise_inplace(Matrix *A) {
+    if (A->n != A->m) {
+        printf("ERROR in LDL_T factorisation. Dimensions of matrix A is %zux%zu, and it should be square.\n", A->n, A->m);
+        return 0;
+    }
+
+    return factorise_symmetric_inplace(A, 1);
+}
+
+// Solve L * L_T * x = b given the Cholesky factor L (lower triangle of L)
+Vector solve_cholesky(Workspace *ws, Matrix L, Vector b) {
+    Vector x; ptrdiff_t i, j, n = L.n; double res;
+    x.size = L.n;
+    x.stride = 1;
+    x.data = (double*)workspace_alloc(ws, sizeof(double)*x.size);
+
+    if (L.n != b.size) {
+        printf("ERROR in solving Cholesky system L*L_T*x = b. Dimensions of matrix L is %zux%zu and of vector b is %zux1\n", L.n, L.m, b.size);
+        return x;
+    }
+
+    // Forward substitution: L * z = b
+    for (i = 0; i < n; i++) {
+        res = b.data[i * b.stride];
+        for (j = 0; j < i; j++) {
+            res -= L.data[i * L.ld + j] * x.data[j];
+        }
+        x.data[i] = res / L.data[i * L.ld + i];
+    }
+
+    // Back substitution: L_T * x = z
+    for (i = n - 1; i >= 0; i--) {
+        res = x.data[i];
+        for (j = i + 1; j < n; j++) {
+            res -= L.data[j * L.ld + i] * x.data[j];
+        }
+        x.data[i] = res / L.data[i * L.ld + i];
+    }
+
+    return x;
+}
+
+// Solve L * D * L_T * x = b given the factors from ldlt_factorise_inplace (unit L below the diagonal, D on it)
+Vector solve_ldlt(Workspace *ws, Matrix LD, Vector b) {
+    Vector x; ptrdiff_t i, j, n = LD.n; double res;
+    x.size = LD.n;
+    x.stride = 1;
+    x.data = (double*)workspace_alloc(ws, sizeof(double)*x.size);
+
+    if (LD.n != b.size) {
+        printf("ERROR in solving LDL_T system L*D*L_T*x = b. Dimensions of matrix LD is %zux%zu and of vector b is %zux1\n", LD.n, LD.m, b.size);
+        return x;
+    }
+
+    // Forward substitution: L * z = b
+    for (i = 0; i < n; i++) {
+        res = b.data[i * b.stride];
+        for (j = 0; j < i; j++) {
+            res -= LD.data[i * LD.ld + j] * x.data[j];
+        }
+        x.data[i] = res;
+    }
+
+    // Back substitution: L_T * x = D^-1 * z
+    for (i = n - 1; i >= 0; i--) {
+        res = x.data[i] / LD.data[i * LD.ld + i];
+        for (j = i + 1; j < n; j++) {
+            res -= LD.data[j * LD.ld + i] * x.data[j];
+        }
+        x.data[i] = res;
+    }
+
+    return x;
+}
+
 // DEBUGGING -----
 
 // Print out a matrix for debugging purposes
 void print_matrix(Matrix X) {
-    int i, j;
+    size_t i, j;
     printf("PRINTING MATRIX X:\n");
     for (i = 0; i < X.n; i++) {
         for (j = 0; j < X.m; j++) {
-            printf("%lf ", X.data[i * X.m + j]);
+            printf("%lf ", X.data[i * X.ld + j]);
         }
         printf("\n");
     }
@@ -321,10 +1354,10 @@ void print_matrix(Matrix X) {
 
 // Print out a vector for debugging purposes
 void print_vector(Vector x) {
-    int i;
+    size_t i;
     printf("PRINTING VECTOR x:\n");
     for (i = 0; i < x.size; i++) {
-        printf("%lf ", x.data[i]);
+        printf("%lf ", x.data[i * x.stride]);
     }
     printf("\n");
 }
\ No newline at end of file
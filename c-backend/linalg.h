@@ -1,6 +1,42 @@
+#ifndef LINALG_H
+#define LINALG_H
+
 #include <stdio.h>
+#include <stddef.h>
+
+// Smallest ratio of a Cholesky pivot to its original diagonal entry before the system is treated as ill-conditioned
+#define CHOLESKY_PIVOT_TOLERANCE 1e-10
+// Number of columns of a Cholesky or LDL_T factorisation updated together in one block
+#define CHOLESKY_BLOCK_SIZE 64
+
+// Number of Householder reflectors applied together in one blocked (WY) update
+#define HOUSEHOLDER_BLOCK_SIZE 16
+// Number of rows processed at a time by a blocked Householder update so they stay in cache
+#define HOUSEHOLDER_ROW_CHUNK 256
+
+// Range of the number of columns p with fixed-size least squares kernels (QR_factorise_givens, solve_back_sub)
+#define SMALL_P_MIN 2
+#define SMALL_P_MAX 8
+
+// Alignment of every array the linalg functions allocate (a cache line, and a whole AVX-512 register)
+#define ARRAY_ALIGNMENT 64
+// Arrays at least this big are aligned to a huge page and marked for transparent huge pages when built
+// with LINALG_HUGE_PAGES (make HUGE_PAGES=1), which cuts TLB misses when streaming over gigabytes
+#define HUGE_PAGE_SIZE (1 << 21)
+
+// Size of the first block of memory of a workspace
+#define WORKSPACE_MIN_BLOCK (1 << 16)
 
 // STRUCTS
+struct WorkspaceBlock;
+typedef struct WorkspaceBlock WorkspaceBlock;
+
+struct Workspace;
+typedef struct Workspace Workspace;
+
+struct WorkspaceMark;
+typedef struct WorkspaceMark WorkspaceMark;
+
 struct Vector;
 typedef struct Vector Vector;
 
@@ -10,17 +46,49 @@ typedef struct Matrix Matrix;
 struct QR;
 typedef struct QR QR;
 
-// Struct for a size x 1 vector
+// Struct for one block of memory of a workspace, chained newest first
+struct WorkspaceBlock {
+    WorkspaceBlock *next;
+    unsigned char *data;
+    size_t size, used;
+};
+
+// Struct for a bump allocator the linalg functions take their results and temporaries from
+// Allocations are never freed one by one: workspace_reset() releases everything at once and keeps the memory,
+// so repeated fits of the same size allocate nothing. Every function taking a Workspace *ws uses aligned_malloc()
+// instead when ws is NULL, and then the caller frees the result with free() as usual. A workspace belongs to one
+// thread at a time.
+struct Workspace {
+    WorkspaceBlock *blocks;
+    size_t used;     // bytes handed out since the last reset
+    size_t peak;     // most bytes handed out at once since init_workspace()
+    size_t capacity; // bytes held in blocks
+};
+
+// Struct for a position in a workspace that workspace_release() can roll it back to
+struct WorkspaceMark {
+    WorkspaceBlock *block;
+    size_t block_used, used;
+};
+
+// Struct for a size x 1 vector, x_i = data[i * stride]
+// Vectors returned by the linalg functions are contiguous (stride 1); a larger stride is a view, e.g. a column of a matrix
+// Sizes and strides are 64 bit so vectors and matrices can hold more than 2^31 entries
 struct Vector {
     double* data;
-    int size; 
+    size_t size; 
+    ptrdiff_t stride;
 };
 
-// Struct for an nxm matrix
+// Struct for an nxm matrix, X_ij = data[i * ld + j]
 // could also implement as a list of pointers 
+// The leading dimension ld is m for the matrices the linalg functions return. A view of a block of a
+// larger matrix keeps that matrix's ld, with data pointing at its first entry (the offset of the view).
+// Views share the memory they look into, so only the matrix that owns it is ever freed.
 struct Matrix {
-    int n, m; 
-    double* data; // data[i][j] = data[i*n + m]
+    size_t n, m; 
+    double* data; // data[i][j] = data[i*ld + j]
+    size_t ld;
 };
 
 // Struct for the 2 matrix output of QR factorisation of matrix X
@@ -30,23 +98,56 @@ struct QR {
 };
 
 // FUNCTION DEFINITIONS
-Matrix transpose_matrix(Matrix X);
-Matrix invert_matrix_2by2(Matrix X);
+void *aligned_malloc(size_t bytes);
+void *aligned_calloc(size_t count, size_t size);
+
+void init_workspace(Workspace *ws);
+void *workspace_alloc(Workspace *ws, size_t bytes);
+void *workspace_calloc(Workspace *ws, size_t count, size_t size);
+void workspace_free(Workspace *ws, void *ptr);
+WorkspaceMark workspace_mark(Workspace *ws);
+void workspace_release(Workspace *ws, WorkspaceMark mark);
+void workspace_reset(Workspace *ws);
+void free_workspace(Workspace *ws);
+
+// Views - no data is copied
+Matrix matrix_view(Matrix X, size_t row, size_t col, size_t n, size_t m);
+Vector row_view(Matrix X, size_t i);
+Vector column_view(Matrix X, size_t j);
+Vector vector_view(Vector x, size_t start, size_t size);
+int is_contiguous_matrix(Matrix X);
+
+Matrix transpose_matrix(Workspace *ws, Matrix X);
+Matrix invert_matrix_2by2(Workspace *ws, Matrix X);
 
 double get_magnitude(Vector x);
-Vector get_column(Matrix X, int i);
-void copy_column_to_matrix_inplace(Vector col, Matrix *X, int col_idx);
+Vector get_column(Workspace *ws, Matrix X, size_t i);
+void copy_column_to_matrix_inplace(Vector col, Matrix *X, size_t col_idx);
 
-Matrix multiply_matrix_matrix(Matrix X, Matrix Y);
-Vector multiply_matrix_vector(Matrix X, Vector y);
+Matrix multiply_matrix_matrix(Workspace *ws, Matrix X, Matrix Y);
+Vector multiply_matrix_vector(Workspace *ws, Matrix X, Vector y);
+Matrix multiply_transpose_matrix_matrix(Workspace *ws, Matrix X, Matrix Y);
+Matrix multiply_transpose_matrix_self(Workspace *ws, Matrix X);
+Vector multiply_transpose_matrix_vector(Workspace *ws, Matrix X, Vector y);
 double multiply_vector_vector(Vector x, Vector y);
 void subtract_vector_vector_inplace(Vector *x, Vector y);
+void subtract_scaled_vector_inplace(Vector *x, double scalar, Vector y);
 void multiply_scalar_vector_inplace(double scalar, Vector *x);
-Vector solve_back_sub(Matrix UT, Vector y);
+Vector solve_back_sub(Workspace *ws, Matrix UT, Vector y);
 int is_upper_triangular(Matrix *X);
 
 // Matrix factorisations
-QR QR_factorise(Matrix X);
+QR QR_factorise(Workspace *ws, Matrix X);
+QR QR_factorise_mgs(Workspace *ws, Matrix X);
+Matrix QR_factorise_householder(Workspace *ws, Matrix X, Vector y, Vector *Q_Ty);
+Matrix QR_factorise_givens(Workspace *ws, Matrix X, Vector y, Vector *Q_Ty);
+Matrix QR_factorise_tsqr(Workspace *ws, Matrix X, Vector y, Vector *Q_Ty, int num_threads);
+int cholesky_factorise_inplace(Matrix *A);
+int ldlt_factorise_inplace(Matrix *A);
+Vector solve_cholesky(Workspace *ws, Matrix L, Vector b);
+Vector solve_ldlt(Workspace *ws, Matrix LD, Vector b);
 
 void print_matrix(Matrix X);
-void print_vector(Vector x);
\ No newline at end of file
+void print_vector(Vector x);
+
+#endif
@@ -3,10 +3,11 @@
 #include <string.h>
 #include <math.h>
 #include "multi.h"
+#include "ingest.h"
 
-/* TODO: 'for further work' comment
-   Note: we are using classical Gram Schmidt here which is potentially numerically unstable 
-    -> if encounter issues switch to the modified gram schmidt method for better stability  :) 
+/* Note: QR factorisation uses Givens rotations for up to SMALL_P_MAX coefficients (QR_factorise_givens) and
+   blocked Householder reflections (QR_factorise_householder) above that. Both are more stable than the Gram
+   Schmidt methods (QR_factorise, QR_factorise_mgs) for nearly dependent columns and never build Q
 */
 
 /* VARIABLES with types
@@ -27,101 +28,95 @@
  => R * b = Q_T * y (solve via back sub)
 */
 
-// GLOBALS -------------------------------
-volatile int n, p;
+/* STREAMING NORMAL EQUATIONS (solve for b) in O(p^2) memory
+    X_T * X and X_T * y are sums of one outer product per row, so they are accumulated
+    while streaming the rows and X is never held in memory. The system is then solved via
+    a Cholesky factorisation X_T * X = L * L_T. Forming X_T * X squares the condition number
+    of X, so when the factorisation reports the system as ill-conditioned we fall back to QR.
+*/
 
 // FUNCTIONS -------------------------------
 
-// Count the number of lines in an input file 
-// and the number of dimensions we are working with
-void set_lines_dimensions(char *filename) {
-    FILE *fptr; 
-    char c;
-    int count = 0; 
-    int dimensions = 1;
+// Struct for the X matrix and y vector grown while the data file is streamed in
+struct RowBuffer {
+    DataInputs *data_inputs;
+    size_t capacity_x, capacity_y;
+};
+
+// Append a row to the growing X matrix and y vector, returns -1 if they could not grow
+// first value is the dependent y variable, and the rest are the explanatory variables
+static int append_row(const double *row, int cols, void *ctx) {
+    struct RowBuffer *buffer = (struct RowBuffer*)ctx;
+    DataInputs *data_inputs = buffer->data_inputs;
+    size_t line_index = data_inputs->y_inputs.size;
+    double *x, *y;
+    int i;
 
-    fptr = fopen(filename, "r");
+    // A buffer that grew is kept even if the other one then cannot, so both stay owned by data_inputs
+    x = grow_buffer(data_inputs->x_inputs.data, &buffer->capacity_x, (size_t)(line_index + 1) * cols);
+    if (x == NULL) {
+        return -1;
+    }
+    data_inputs->x_inputs.data = x;
+    y = grow_buffer(data_inputs->y_inputs.data, &buffer->capacity_y, line_index + 1);
+    if (y == NULL) {
+        return -1;
+    }
+    data_inputs->y_inputs.data = y;
 
-    if (fptr == NULL) {
-        printf("Failed at counting lines for file: `%s`\n", filename);
-        return;
+    // Each row of matrix X starts with a 1
+    data_inputs->y_inputs.data[line_index] = row[0];
+    data_inputs->x_inputs.data[line_index*cols] = 1.0f;
+    for (i = 1; i < cols; i++) {
+        data_inputs->x_inputs.data[line_index*cols + i] = row[i];
     }
 
-    for (c = getc(fptr); c != EOF; c = getc(fptr)) {
-        if (c == ',') {
-            dimensions++;
-        }
+    data_inputs->x_inputs.n = data_inputs->y_inputs.size = line_index + 1;
+    data_inputs->x_inputs.m = data_inputs->x_inputs.ld = cols;
+    data_inputs->y_inputs.stride = 1;
+    return 0;
+}
 
-        if (c == '\n') { 
-            count++; 
-            dimensions = 1;
-        }
+// Read the rows of a csv file, or of csv text in memory if filename is NULL, into the regression
+// Returns 0 on success and -1 if the input could not be read
+static int load_rows(MultiRegression *regression, char *filename, const char *data, size_t length) {
+    struct RowBuffer buffer;
+
+    // Only the rows are replaced, the workspace is kept for the next fit
+    free(regression->data_inputs.x_inputs.data);
+    free(regression->data_inputs.y_inputs.data);
+    regression->data_inputs.x_inputs.n = regression->data_inputs.x_inputs.m = regression->data_inputs.x_inputs.ld = 0;
+    regression->data_inputs.y_inputs.size = 0;
+    regression->data_inputs.y_inputs.stride = 1;
+    regression->data_inputs.x_inputs.data = regression->data_inputs.y_inputs.data = NULL;
+    regression->b.size = 0;
+    regression->b.stride = 1;
+    regression->b.data = NULL;
+    buffer.data_inputs = &regression->data_inputs;
+    buffer.capacity_x = buffer.capacity_y = 0;
+
+    if (filename != NULL) {
+        return ingest_rows(filename, append_row, &buffer, &regression->ingest_stats);
     }
-
-    fclose(fptr);
-    n = count+1;
-    p = dimensions;
+    return ingest_buffer(data, length, append_row, &buffer, &regression->ingest_stats);
 }
 
-// Read the data input from the csv file
+// Read the data input from the csv file in a single pass
 DataInputs read_data(void) {
-    FILE *fptr;  
-    DataInputs data_inputs;
-    char c, line[1000];
-    int line_index = 0;
-    double x, y;
-
-    data_inputs.x_inputs.n= n;
-    data_inputs.x_inputs.m= p;
-    data_inputs.y_inputs.size = n;
-    data_inputs.x_inputs.data = (double*)malloc(n*p*sizeof(double));
-    data_inputs.y_inputs.data = (double*)malloc(n*sizeof(double));
-
-    fptr = fopen("../data/data.txt", "r");
-
-    if (fptr != NULL) {
-
-        while (fgets(line, sizeof(line), fptr)) {
-            char *line_ptr = line; // pointer to line we are currently on 
-            int scanned_count = 0; // the number of characters successfully scanned in the line - how far we've advanced in the string
-            double value; // last value scanned 
-
-            // Loop p times to extract p values
-            // first value is the dependent y variable, and the rest are the explanatory variables
-            for (int i = 0; i < p; i++) {
-                if (sscanf(line_ptr, "%lf%*[, \t]%n", &value, &scanned_count) == 1) { // scan the next double and consume a comma, storing number of chars successfully scanned so far into scanned count
-                    if (i == 0) {
-                        // First value is the dependent variable and each row of matrix X starts with a 1 
-                        data_inputs.y_inputs.data[line_index] = value;
-                        data_inputs.x_inputs.data[line_index*p] = 1.0f;
-                    } else {
-                        // Store values into the matrix X 
-                        data_inputs.x_inputs.data[line_index*p + i] = value;
-                    }
-
-                    // Advance the pointer for the next scan
-                    line_ptr += scanned_count;
-                } else {
-                    fprintf(stderr, "Invalid line format at line %d: %s\n", line_index+1, line);
-                    break;
-                }
-            }
-            line_index++;
-        }
+    MultiRegression regression;
 
-    } else {
-        printf("Not able to open the file: `../data/data.txt`\n");
+    init_multi_regression(&regression);
+    if (load_rows(&regression, "../data/data.txt", NULL, 0) == 0) {
+        print_ingest_stats("../data/data.txt", &regression.ingest_stats);
     }
 
-    fclose(fptr);
-
-    return data_inputs;
+    return regression.data_inputs;
 }
 
 // Testing the function that solves a consistent square upper triangular system via back substitution
 void test_back_sub(void) {
     Matrix UT; Vector y;
-    UT.n = UT.m = 3; y.size = 3;
+    UT.n = UT.m = UT.ld = 3; y.size = 3; y.stride = 1;
     UT.data = (double*)malloc(sizeof(double)*UT.n*UT.m); y.data = (double*)malloc(sizeof(double)*y.size);
 
     UT.data[0] = 2;
@@ -138,7 +133,7 @@ void test_back_sub(void) {
     y.data[1] = 4;
     y.data[2] = 8;
 
-    Vector x = solve_back_sub(UT, y);
+    Vector x = solve_back_sub(NULL, UT, y);
     print_vector(x);
     if (x.data[0] == 3.5f && x.data[1] == 0.0f && x.data[2] == 2.0f){
         printf("Back substitution test passed :)\n");
@@ -153,7 +148,7 @@ void test_back_sub(void) {
 // Testing various functions briefly
 void testing(void) {
     Vector x; Matrix y;
-    x.size = 2; y.n = y.m = 2;
+    x.size = 2; x.stride = 1; y.n = y.m = y.ld = 2;
     x.data = (double*)malloc(sizeof(double)*2);
     x.data[0] = 1.0f; x.data[1] = 2.0f;
     y.data = (double*)malloc(sizeof(double)*4);
@@ -180,66 +175,350 @@ void testing(void) {
 
 // Print a plane given the coefficients necessary
 void print_plane(Vector *coefficients) {
-    int i;
+    size_t i;
     printf("Y = ");
     printf("%lf", coefficients->data[0]);
     for (i = 1; i < coefficients->size; i++) {
-        printf(" + %lf*X_%d", coefficients->data[i], i);
+        printf(" + %lf*X_%zu", coefficients->data[i], i);
     }
     printf("\n");
 }
 
 // Save the plane coefficients to a csv file for 3d plotting in python
 void save_plane(Vector *coefficients) {
-    int i;
+    size_t i;
     FILE *fptr;
     fptr = fopen("../data/plane.txt", "w");
-    for (i = 0; i < coefficients->size-1;i++) {
+    for (i = 0; i + 1 < coefficients->size;i++) {
         fprintf(fptr, "%lf,", coefficients->data[i]);
     }
     fprintf(fptr, "%lf", coefficients->data[coefficients->size-1]);
     fclose(fptr);
 }
 
-void multiple_regression(void) {
-    printf("Running Multiple Linear Regression on Input from `../data/data.txt`\n");
-    // testing();
+// Solve the least squares problem for the data inputs by QR factorisation of X
+// The Givens QR (blocked Householder above SMALL_P_MAX columns) applies Q_T to y as it goes, so neither Q nor Q_T is formed
+Vector solve_qr(Workspace *ws, DataInputs data_inputs) {
+    Vector Q_Ty;
 
-    // Loading in data 
-    set_lines_dimensions("../data/data.txt");
-    // printf("Number of datapoints: %d\n", n);
-    // printf("Number of dimensions: %d\n", p);
-
-    // Matrix X = data_inputs.x_inputs
-    DataInputs data_inputs = read_data();
-    // print_matrix(data_inputs.x_inputs);
-    
     // PERFORM QR FACTORISATION OF X ===========
-    QR qr = QR_factorise(data_inputs.x_inputs);
-    // print_matrix(qr.Q);
-    // print_matrix(qr.R);
+    Matrix R = QR_factorise_givens(ws, data_inputs.x_inputs, data_inputs.y_inputs, &Q_Ty);
+    // print_matrix(R);
 
     // PERFORM MULTIPLE LINEAR REGRESSION ===========
     // R*b = Q_T * y
-    Matrix Q_T = transpose_matrix(qr.Q);
-    Vector z = multiply_matrix_vector(Q_T, data_inputs.y_inputs);
-    Vector b = solve_back_sub(qr.R, z);
+    Vector b = solve_back_sub(ws, R, Q_Ty);
+
+    workspace_free(ws, R.data);
+    workspace_free(ws, Q_Ty.data);
+
+    return b;
+}
+
+// Solve the least squares problem by tall-skinny QR across num_threads threads (all cores if num_threads <= 0)
+Vector solve_tsqr(Workspace *ws, DataInputs data_inputs, int num_threads) {
+    Vector Q_Ty;
+    Matrix R = QR_factorise_tsqr(ws, data_inputs.x_inputs, data_inputs.y_inputs, &Q_Ty, num_threads);
+    Vector b = solve_back_sub(ws, R, Q_Ty);
+
+    workspace_free(ws, R.data);
+    workspace_free(ws, Q_Ty.data);
+
+    return b;
+}
+
+// Fit a plane to ../data/data.txt across num_threads threads (see fit_multi_regression), then print and save it
+// Returns 0 on success and -1 if the data could not be read or does not determine a plane
+static int run_multi_regression(int num_threads) {
+    MultiRegression regression;
+    int status;
+
+    // Loading in data 
+    // Matrix X = regression.data_inputs.x_inputs
+    init_multi_regression(&regression);
+    status = load_multi_regression_file(&regression, "../data/data.txt");
+    if (status == 0) {
+        print_ingest_stats("../data/data.txt", &regression.ingest_stats);
+        status = fit_multi_regression(&regression, num_threads);
+    }
+
+    if (status == 0) {
+        printf("Peak workspace %.2f MB\n", regression.workspace.peak / 1e6);
+        printf("Your regression plane equation is:\n");
+        print_plane(&regression.b);
+        save_plane(&regression.b);
+    }
+
+    // Free used memory
+    free_multi_regression(&regression);
+    return status;
+}
+
+// Returns 0 on success and -1 if the data could not be read or does not determine a plane
+int multiple_regression(void) {
+    printf("Running Multiple Linear Regression on Input from `../data/data.txt`\n");
+    return run_multi_regression(1);
+}
+
+// Multiple linear regression with the QR factorisation split across num_threads threads (all cores if num_threads <= 0)
+// Returns 0 on success and -1 if the data could not be read or does not determine a plane
+int multiple_regression_parallel(int num_threads) {
+    printf("Running Parallel Multiple Linear Regression on Input from `../data/data.txt`\n");
+    return run_multi_regression(num_threads);
+}
+
+// Start an empty regression with no rows loaded
+void init_multi_regression(MultiRegression *regression) {
+    regression->data_inputs.x_inputs.n = regression->data_inputs.x_inputs.m = regression->data_inputs.x_inputs.ld = 0;
+    regression->data_inputs.y_inputs.size = 0;
+    regression->data_inputs.y_inputs.stride = 1;
+    regression->data_inputs.x_inputs.data = regression->data_inputs.y_inputs.data = NULL;
+    regression->ingest_stats.bytes = 0;
+    regression->ingest_stats.rows = regression->ingest_stats.cols = 0;
+    regression->ingest_stats.seconds = 0.0;
+    regression->b.size = 0;
+    regression->b.stride = 1;
+    regression->b.data = NULL;
+    init_workspace(&regression->workspace);
+}
+
+// Load the rows of a csv file in format 'y,x_1,...,x_p-1' ('-' for stdin), replacing any loaded before
+// Returns 0 on success and -1 if the file could not be read
+int load_multi_regression_file(MultiRegression *regression, char *filename) {
+    return load_rows(regression, filename, NULL, 0);
+}
+
+// Load the rows of csv text in format 'y,x_1,...,x_p-1' held in memory, replacing any loaded before
+int load_multi_regression_buffer(MultiRegression *regression, const char *data, size_t length) {
+    return load_rows(regression, NULL, data, length);
+}
+
+// Fit the coefficients b to the loaded rows by QR factorisation, split across num_threads threads
+// (all cores if num_threads <= 0). With 1 thread this is QR_factorise_givens on this thread, the same
+// factorisation each TSQR thread runs on its block: Givens rotations up to SMALL_P_MAX columns, Householder above
+// Returns 0 on success and -1 if there are fewer rows than coefficients
+int fit_multi_regression(MultiRegression *regression, int num_threads) {
+    Matrix X = regression->data_inputs.x_inputs;
+
+    regression->b.size = 0;
+    regression->b.stride = 1;
+    regression->b.data = NULL;
+
+    if (X.m < 1 || X.n < X.m) {
+        printf("ERROR in multiple regression. Need at least as many rows as coefficients but got %zu rows for %zu coefficients\n", X.n, X.m);
+        return -1;
+    }
+
+    // Everything the previous fit allocated, b included, is released at once and its memory reused
+    workspace_reset(&regression->workspace);
+    if (num_threads == 1) {
+        regression->b = solve_qr(&regression->workspace, regression->data_inputs);
+    } else {
+        regression->b = solve_tsqr(&regression->workspace, regression->data_inputs, num_threads);
+    }
+    return 0;
+}
+
+// Free the loaded rows and the workspace holding the coefficients, leaving an empty regression that can be loaded again
+void free_multi_regression(MultiRegression *regression) {
+    free(regression->data_inputs.x_inputs.data);
+    free(regression->data_inputs.y_inputs.data);
+    free_workspace(&regression->workspace);
+    init_multi_regression(regression);
+}
+
+// Copy the fitted coefficients of a regression into b and free it
+// Returns the number of coefficients, or -1 if the fit failed or b cannot hold them all
+static int take_coefficients(MultiRegression *regression, int status, double *b, int capacity) {
+    if (status == 0 && (capacity < 0 || regression->b.size > (size_t)capacity)) {
+        printf("ERROR in multiple regression. %zu coefficients do not fit in space for %d\n", regression->b.size, capacity);
+        status = -1;
+    }
+    if (status == 0) {
+        memcpy(b, regression->b.data, regression->b.size * sizeof(double));
+        status = (int)regression->b.size;
+    }
+    free_multi_regression(regression);
+    return status;
+}
+
+// Fit a plane to a csv file in one call on this thread, writing up to capacity coefficients to b
+// Returns the number of coefficients, or -1 on failure
+int multiple_regression_from_file(char *filename, double *b, int capacity) {
+    MultiRegression regression;
+    int status;
+
+    init_multi_regression(&regression);
+    status = load_multi_regression_file(&regression, filename);
+    if (status == 0) {
+        status = fit_multi_regression(&regression, 1);
+    }
+    return take_coefficients(&regression, status, b, capacity);
+}
+
+// Fit a plane to csv text held in memory in one call on this thread, writing up to capacity coefficients to b
+// Returns the number of coefficients, or -1 on failure
+int multiple_regression_from_buffer(const char *data, size_t length, double *b, int capacity) {
+    MultiRegression regression;
+    int status;
+
+    init_multi_regression(&regression);
+    status = load_multi_regression_buffer(&regression, data, length);
+    if (status == 0) {
+        status = fit_multi_regression(&regression, 1);
+    }
+    return take_coefficients(&regression, status, b, capacity);
+}
+
+// Reset the Gram statistics - the dimensions are set by the first row
+void init_gram_stats(GramStats *stats) {
+    stats->p = 0;
+    stats->count = 0;
+    stats->shift = NULL;
+    stats->x_row = NULL;
+    stats->X_TX.n = stats->X_TX.m = stats->X_TX.ld = 0;
+    stats->X_TX.data = NULL;
+    stats->X_Ty.size = 0;
+    stats->X_Ty.stride = 1;
+    stats->X_Ty.data = NULL;
+}
+
+// Add one input row (y, x_1, ..., x_p-1) to X_T*X and X_T*y
+// Returns 0 on success and -1 if the statistics could not be allocated for the first row
+int update_gram_stats(GramStats *stats, const double *row, int cols) {
+    int i, j, dims = cols;
+    double y;
+
+    if (stats->count == 0) {
+        stats->shift = (double*)malloc(dims * sizeof(double));
+        stats->x_row = (double*)malloc(dims * sizeof(double));
+        stats->X_TX.data = (double*)calloc(dims * dims, sizeof(double));
+        stats->X_Ty.data = (double*)calloc(dims, sizeof(double));
+        if (stats->shift == NULL || stats->x_row == NULL || stats->X_TX.data == NULL || stats->X_Ty.data == NULL) {
+            printf("ERROR in multiple regression. Could not allocate the Gram statistics for %d columns\n", dims);
+            free_gram_stats(stats);
+            return -1;
+        }
+        stats->p = dims;
+        memcpy(stats->shift, row, dims * sizeof(double));
+        stats->X_TX.n = stats->X_TX.m = stats->X_TX.ld = dims;
+        stats->X_Ty.size = dims;
+    }
+
+    // Shifted row of X: 1 followed by the explanatory variables minus those of the first row
+    y = row[0] - stats->shift[0];
+    stats->x_row[0] = 1.0;
+    for (i = 1; i < dims; i++) {
+        stats->x_row[i] = row[i] - stats->shift[i];
+    }
+
+    // Rank one update of the upper triangle of X_T*X and of X_T*y
+    for (i = 0; i < dims; i++) {
+        double x_i = stats->x_row[i];
+        double *gram_row = stats->X_TX.data + i * dims;
+        for (j = i; j < dims; j++) {
+            gram_row[j] += x_i * stats->x_row[j];
+        }
+        stats->X_Ty.data[i] += x_i * y;
+    }
+
+    stats->count++;
+    return 0;
+}
+
+// Solve the accumulated normal equations via Cholesky, storing the coefficients in b
+// Returns 1 on success, 0 if X_T*X is too ill-conditioned for the normal equations and -1 if there are no more
+// rows than coefficients
+int solve_gram_stats(GramStats *stats, Vector *b) {
+    int i;
+
+    if (stats->count == 0 || stats->count <= stats->p) {
+        printf("ERROR in multiple regression. Need more rows than coefficients but got %lld rows for %d coefficients\n", stats->count, stats->p);
+        return -1;
+    }
+    if (cholesky_factorise_inplace(&stats->X_TX) == 0) {
+        return 0;
+    }
+
+    *b = solve_cholesky(NULL, stats->X_TX, stats->X_Ty);
+
+    // Undo the shift: y - y_0 = b'_0 + sum_i b_i (x_i - x_0i) so b_0 = b'_0 + y_0 - sum_i b_i x_0i
+    b->data[0] += stats->shift[0];
+    for (i = 1; i < stats->p; i++) {
+        b->data[0] -= b->data[i] * stats->shift[i];
+    }
+
+    return 1;
+}
+
+// Free the memory held by the Gram statistics
+void free_gram_stats(GramStats *stats) {
+    free(stats->shift);
+    free(stats->x_row);
+    free(stats->X_TX.data);
+    free(stats->X_Ty.data);
+    init_gram_stats(stats);
+}
+
+// Add a streamed row to the Gram statistics, returns -1 to stop the ingest if they could not be allocated
+static int accumulate_row(const double *row, int cols, void *ctx) {
+    return update_gram_stats((GramStats*)ctx, row, cols);
+}
+
+// Multiple linear regression in O(p^2) memory by streaming the rows into the normal equations
+// Returns 0 on success and -1 if the data could not be read or does not determine a plane
+int multiple_regression_streaming(void) {
+    GramStats stats;
+    IngestStats ingest_stats;
+    Vector b;
+    int solved;
+
+    printf("Running Streaming Multiple Linear Regression on Input from `../data/data.txt`\n");
+
+    init_gram_stats(&stats);
+    if (ingest_rows("../data/data.txt", accumulate_row, &stats, &ingest_stats) != 0) {
+        free_gram_stats(&stats);
+        return -1;
+    }
+    print_ingest_stats("../data/data.txt", &ingest_stats);
+
+    solved = solve_gram_stats(&stats, &b);
+    if (solved < 0) {
+        free_gram_stats(&stats);
+        return -1;
+    }
+    if (solved == 0) {
+        // Fall back to QR on the full data, which needs X in memory
+        printf("BEWARE: X_T*X is ill-conditioned, falling back to QR factorisation of the full data.\n");
+        DataInputs data_inputs = read_data();
+        if (data_inputs.x_inputs.n < data_inputs.x_inputs.m || data_inputs.x_inputs.m < 1) {
+            free(data_inputs.x_inputs.data);
+            free(data_inputs.y_inputs.data);
+            free_gram_stats(&stats);
+            return -1;
+        }
+        b = solve_qr(NULL, data_inputs);
+        free(data_inputs.x_inputs.data);
+        free(data_inputs.y_inputs.data);
+    }
+
     printf("Your regression plane equation is:\n");
     print_plane(&b);
     save_plane(&b);
 
-    // Free used memory
-    free(data_inputs.x_inputs.data);
-    free(data_inputs.y_inputs.data);
-    free(qr.Q.data);
-    free(qr.R.data);
-    free(Q_T.data);
-    free(z.data);
+    free_gram_stats(&stats);
     free(b.data);
+    return 0;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     printf("DISCLAIMER: MULTIPLE LINEAR REGRESSION IS CURRENTLY STILL PRONE TO INSTABILITY ISSUES.\n");
-    multiple_regression();
-    return 0;
+    // --stream: fit without loading the data into memory
+    // --threads N: split the QR factorisation across N threads (0 for all cores)
+    if (argc > 1 && strcmp(argv[1], "--stream") == 0) {
+        return multiple_regression_streaming() == 0 ? 0 : 1;
+    } else if (argc > 1 && strcmp(argv[1], "--threads") == 0) {
+        return multiple_regression_parallel(argc > 2 ? atoi(argv[2]) : 0) == 0 ? 0 : 1;
+    }
+    return multiple_regression() == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -1,22 +1,54 @@
 #include <stdio.h>
 #include "linalg.h"
+#include "ingest.h"
 
 // STRUCTS
 struct DataInputs;
 typedef struct DataInputs DataInputs;
 
+struct GramStats;
+typedef struct GramStats GramStats;
+
+struct MultiRegression;
+typedef struct MultiRegression MultiRegression;
+
 // Struct for the 2 vector inputs of x and y values
 struct DataInputs {
     Matrix x_inputs;
     Vector y_inputs;
 };
 
+// Struct for the pxp Gram matrix X_T*X and px1 vector X_T*y accumulated one row at a time
+// Every row is shifted by the first row seen, which keeps the sums small relative to their spread
+struct GramStats {
+    int p;
+    long long count;
+    double *shift;  // first input row (y, x_1, ..., x_p-1)
+    double *x_row;  // scratch for the current shifted row of X
+    Matrix X_TX;    // only the upper triangle is accumulated
+    Vector X_Ty;
+};
+
+// Struct for one multiple regression problem: its X matrix and y vector and the fitted coefficients b
+// All state lives in the struct, so separate problems can be loaded and fitted on different threads at once
+struct MultiRegression {
+    DataInputs data_inputs;
+    IngestStats ingest_stats;
+    Vector b;  // (b_0, ..., b_p-1) held in the workspace, size 0 until fitted
+    Workspace workspace; // reset on every fit, workspace.peak is the most memory a fit has needed
+};
+
 // FUNCTION DEFINITIONS
 
 // Data handling
-void set_lines_dimensions(char *filename);
 DataInputs read_data(void);
 
+// Out-of-core normal equations
+void init_gram_stats(GramStats *stats);
+int update_gram_stats(GramStats *stats, const double *row, int cols);
+int solve_gram_stats(GramStats *stats, Vector *b);
+void free_gram_stats(GramStats *stats);
+
 // Debugging
 void print_plane(Vector *coefficients);
 void save_plane(Vector *coefficients);
@@ -24,5 +56,17 @@ void testing(void);
 void test_back_sub(void);
 
 // Orchestration
-void multiple_regression(void);
-int main(void);
\ No newline at end of file
+Vector solve_qr(Workspace *ws, DataInputs data_inputs);
+Vector solve_tsqr(Workspace *ws, DataInputs data_inputs, int num_threads);
+void init_multi_regression(MultiRegression *regression);
+int load_multi_regression_file(MultiRegression *regression, char *filename);
+int load_multi_regression_buffer(MultiRegression *regression, const char *data, size_t length);
+int fit_multi_regression(MultiRegression *regression, int num_threads);
+void free_multi_regression(MultiRegression *regression);
+int multiple_regression_from_file(char *filename, double *b, int capacity);
+int multiple_regression_from_buffer(const char *data, size_t length, double *b, int capacity);
+
+int multiple_regression(void);
+int multiple_regression_parallel(int num_threads);
+int multiple_regression_streaming(void);
+int main(int argc, char **argv);
\ No newline at end of file
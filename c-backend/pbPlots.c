@@ -1,6 +1,10 @@
 /* Downloaded from https://repo.progsbase.com - Code Developed Using progsbase. */
 
 #include "pbPlots.h"
+#include "png.h"
+
+#include <pthread.h>
+#include <unistd.h>
 
 #define strparam(str) (str), wcslen(str)
 
@@ -148,8 +152,10 @@ RGBABitmapImageReference *CreateRGBABitmapImageReference(){
 
   reference = (RGBABitmapImageReference *)malloc(sizeof(RGBABitmapImageReference));
   reference->image = (RGBABitmapImage *)malloc(sizeof(RGBABitmapImage));
-  reference->image->x = (RGBABitmap**)malloc(sizeof(RGBABitmap) * 0.0);
+  reference->image->pixels = NULL;
   reference->image->xLength = 0.0;
+  reference->image->yLength = 0.0;
+  ResetImageClip(reference->image);
 
   return reference;
 }
@@ -808,6 +814,8 @@ if(settings->yAxisLeft){
       y1Ref = (NumberReference *)malloc(sizeof(NumberReference));
       x2Ref = (NumberReference *)malloc(sizeof(NumberReference));
       y2Ref = (NumberReference *)malloc(sizeof(NumberReference));
+      /* Only point markers are drawn tile by tile in parallel (DrawScatterPlotPoints). Lines stay serial:
+         patternOffset carries the dash phase from one segment to the next, and a series has few segments. */
       if(linearInterpolation){
         prevSet = false;
         xPrev = 0.0;
@@ -857,39 +865,10 @@ if(settings->yAxisLeft){
           xPrev = x;
           yPrev = y;
         }
+      }else if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"density"))){
+        DrawScatterPlotDensity(canvas, sp, xMin, xMax, yMin, yMax, xPixelMin, xPixelMax, yPixelMin, yPixelMax);
       }else{
-        for(i = 0.0; i < xsLength; i = i + 1.0){
-          x = xs[(int)(i)];
-          y = ys[(int)(i)];
-
-          if(x > xMin && x < xMax && y > yMin && y < yMax){
-
-            x = floor(MapXCoordinate(x, xMin, xMax, xPixelMin, xPixelMax));
-            y = floor(MapYCoordinate(y, yMin, yMax, yPixelMin, yPixelMax));
-
-            if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"crosses"))){
-              DrawPixel(canvas, x, y, sp->color);
-              DrawPixel(canvas, x + 1.0, y, sp->color);
-              DrawPixel(canvas, x + 2.0, y, sp->color);
-              DrawPixel(canvas, x - 1.0, y, sp->color);
-              DrawPixel(canvas, x - 2.0, y, sp->color);
-              DrawPixel(canvas, x, y + 1.0, sp->color);
-              DrawPixel(canvas, x, y + 2.0, sp->color);
-              DrawPixel(canvas, x, y - 1.0, sp->color);
-              DrawPixel(canvas, x, y - 2.0, sp->color);
-            }else if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"circles"))){
-              DrawCircle(canvas, x, y, 3.0, sp->color);
-            }else if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"dots"))){
-              DrawFilledCircle(canvas, x, y, 3.0, sp->color);
-            }else if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"triangles"))){
-              DrawTriangle(canvas, x, y, 3.0, sp->color);
-            }else if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"filled triangles"))){
-              DrawFilledTriangle(canvas, x, y, 3.0, sp->color);
-            }else if(aStringsEqual(sp->pointType, sp->pointTypeLength, strparam(L"pixels"))){
-              DrawPixel(canvas, x, y, sp->color);
-            }
-          }
-        }
+        DrawScatterPlotPoints(canvas, sp, xMin, xMax, yMin, yMax, xPixelMin, xPixelMax, yPixelMin, yPixelMax, 0.0);
       }
     }
 
@@ -899,6 +878,224 @@ if(settings->yAxisLeft){
 
   return success;
 }
+void DrawScatterPlotPoint(RGBABitmapImage *canvas, double x, double y, wchar_t *pointType, size_t pointTypeLength, RGBA *color){
+  if(aStringsEqual(pointType, pointTypeLength, strparam(L"crosses"))){
+    DrawPixel(canvas, x, y, color);
+    DrawPixel(canvas, x + 1.0, y, color);
+    DrawPixel(canvas, x + 2.0, y, color);
+    DrawPixel(canvas, x - 1.0, y, color);
+    DrawPixel(canvas, x - 2.0, y, color);
+    DrawPixel(canvas, x, y + 1.0, color);
+    DrawPixel(canvas, x, y + 2.0, color);
+    DrawPixel(canvas, x, y - 1.0, color);
+    DrawPixel(canvas, x, y - 2.0, color);
+  }else if(aStringsEqual(pointType, pointTypeLength, strparam(L"circles"))){
+    DrawCircle(canvas, x, y, 3.0, color);
+  }else if(aStringsEqual(pointType, pointTypeLength, strparam(L"dots"))){
+    DrawFilledCircle(canvas, x, y, 3.0, color);
+  }else if(aStringsEqual(pointType, pointTypeLength, strparam(L"triangles"))){
+    DrawTriangle(canvas, x, y, 3.0, color);
+  }else if(aStringsEqual(pointType, pointTypeLength, strparam(L"filled triangles"))){
+    DrawFilledTriangle(canvas, x, y, 3.0, color);
+  }else if(aStringsEqual(pointType, pointTypeLength, strparam(L"pixels"))){
+    DrawPixel(canvas, x, y, color);
+  }
+}
+/* The points of one series mapped to pixels and binned by the tiles their markers reach */
+struct ScatterTiles{
+  RGBABitmapImage *canvas;
+  ScatterPlotSeries *sp;
+  double *pxs;
+  double *pys;
+  size_t tilesX;
+  size_t tilesY;
+  size_t *binStart;
+  size_t *bins;
+  size_t nextTile;
+  pthread_mutex_t lock;
+};
+/* Worker of the pool: takes the next undrawn tile until none are left */
+static void *DrawScatterTiles(void *arg){
+  struct ScatterTiles *tiles;
+  RGBABitmapImage view;
+  RGBA color;
+  size_t tile, tx, ty, k, i;
+
+  tiles = (struct ScatterTiles *)arg;
+
+  /* Own copies, as markers change the colour while they draw and every tile is clipped differently */
+  view = *tiles->canvas;
+  color = *tiles->sp->color;
+
+  for(;;){
+    pthread_mutex_lock(&tiles->lock);
+    tile = tiles->nextTile;
+    tiles->nextTile = tiles->nextTile + 1;
+    pthread_mutex_unlock(&tiles->lock);
+    if(tile >= tiles->tilesX*tiles->tilesY){
+      break;
+    }
+
+    tx = tile % tiles->tilesX;
+    ty = tile/tiles->tilesX;
+    view.clipX0 = tx*SCATTER_TILE_SIZE;
+    view.clipY0 = ty*SCATTER_TILE_SIZE;
+    view.clipX1 = fmin(view.clipX0 + SCATTER_TILE_SIZE, tiles->canvas->xLength);
+    view.clipY1 = fmin(view.clipY0 + SCATTER_TILE_SIZE, tiles->canvas->yLength);
+
+    /* Every pixel of the tile sees the points that reach it in series order, as in the serial path */
+    for(k = tiles->binStart[tile]; k < tiles->binStart[tile + 1]; k = k + 1){
+      i = tiles->bins[k];
+      DrawScatterPlotPoint(&view, tiles->pxs[i], tiles->pys[i], tiles->sp->pointType, tiles->sp->pointTypeLength, &color);
+    }
+  }
+
+  return NULL;
+}
+/* Range of tiles along one axis reached by a marker centred on pixel p */
+static void ScatterTileRange(double p, size_t tiles, size_t *first, size_t *last){
+  *first = fmax(0.0, floor((p - SCATTER_POINT_REACH)/SCATTER_TILE_SIZE));
+  *last = fmax(0.0, fmin(tiles - 1.0, floor((p + SCATTER_POINT_REACH)/SCATTER_TILE_SIZE)));
+}
+void DrawScatterPlotPoints(RGBABitmapImage *canvas, ScatterPlotSeries *sp, double xMin, double xMax, double yMin, double yMax, double xPixelMin, double xPixelMax, double yPixelMin, double yPixelMax, double threads){
+  struct ScatterTiles tiles;
+  size_t i, n, tx, ty, x0, x1, y0, y1, tileCount, *fill;
+  pthread_t *workers;
+  _Bool *started;
+  double x, y;
+
+  if(threads <= 0.0){
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  /* Map the points inside the boundaries to pixels, keeping their order */
+  tiles.pxs = (double *)malloc(sp->xsLength*sizeof(double) + 1);
+  tiles.pys = (double *)malloc(sp->xsLength*sizeof(double) + 1);
+  n = 0;
+  for(i = 0; i < sp->xsLength; i = i + 1){
+    x = sp->xs[i];
+    y = sp->ys[i];
+
+    if(x > xMin && x < xMax && y > yMin && y < yMax){
+      tiles.pxs[n] = floor(MapXCoordinate(x, xMin, xMax, xPixelMin, xPixelMax));
+      tiles.pys[n] = floor(MapYCoordinate(y, yMin, yMax, yPixelMin, yPixelMax));
+      n = n + 1;
+    }
+  }
+
+  tiles.tilesX = (canvas->xLength + SCATTER_TILE_SIZE - 1)/SCATTER_TILE_SIZE;
+  tiles.tilesY = (canvas->yLength + SCATTER_TILE_SIZE - 1)/SCATTER_TILE_SIZE;
+  tileCount = tiles.tilesX*tiles.tilesY;
+
+  if(threads < 2.0 || n < SCATTER_TILE_MIN_POINTS || tileCount < 2){
+    for(i = 0; i < n; i = i + 1){
+      DrawScatterPlotPoint(canvas, tiles.pxs[i], tiles.pys[i], sp->pointType, sp->pointTypeLength, sp->color);
+    }
+  }else{
+    /* Bin every point into each tile its marker reaches: count, prefix sum, then fill in point order */
+    tiles.binStart = (size_t *)calloc(tileCount + 1, sizeof(size_t));
+    for(i = 0; i < n; i = i + 1){
+      ScatterTileRange(tiles.pxs[i], tiles.tilesX, &x0, &x1);
+      ScatterTileRange(tiles.pys[i], tiles.tilesY, &y0, &y1);
+      for(ty = y0; ty <= y1; ty = ty + 1){
+        for(tx = x0; tx <= x1; tx = tx + 1){
+          tiles.binStart[ty*tiles.tilesX + tx + 1] = tiles.binStart[ty*tiles.tilesX + tx + 1] + 1;
+        }
+      }
+    }
+    for(i = 0; i < tileCount; i = i + 1){
+      tiles.binStart[i + 1] = tiles.binStart[i + 1] + tiles.binStart[i];
+    }
+
+    tiles.bins = (size_t *)malloc(tiles.binStart[tileCount]*sizeof(size_t) + 1);
+    fill = (size_t *)malloc(tileCount*sizeof(size_t));
+    memcpy(fill, tiles.binStart, tileCount*sizeof(size_t));
+    for(i = 0; i < n; i = i + 1){
+      ScatterTileRange(tiles.pxs[i], tiles.tilesX, &x0, &x1);
+      ScatterTileRange(tiles.pys[i], tiles.tilesY, &y0, &y1);
+      for(ty = y0; ty <= y1; ty = ty + 1){
+        for(tx = x0; tx <= x1; tx = tx + 1){
+          tiles.bins[fill[ty*tiles.tilesX + tx]] = i;
+          fill[ty*tiles.tilesX + tx] = fill[ty*tiles.tilesX + tx] + 1;
+        }
+      }
+    }
+    free(fill);
+
+    /* Tiles do not overlap, so the workers never write the same pixel */
+    tiles.canvas = canvas;
+    tiles.sp = sp;
+    tiles.nextTile = 0;
+    pthread_mutex_init(&tiles.lock, NULL);
+
+    threads = fmin(threads, tileCount);
+    workers = (pthread_t *)malloc(threads*sizeof(pthread_t));
+    started = (_Bool *)calloc(threads, sizeof(_Bool));
+    for(i = 1; i < threads; i = i + 1){
+      started[i] = pthread_create(&workers[i], NULL, DrawScatterTiles, &tiles) == 0;
+    }
+    /* This thread works too, and finishes the tiles alone if no other thread could be started */
+    DrawScatterTiles(&tiles);
+    for(i = 1; i < threads; i = i + 1){
+      if(started[i]){
+        pthread_join(workers[i], NULL);
+      }
+    }
+
+    pthread_mutex_destroy(&tiles.lock);
+    free(workers);
+    free(started);
+    free(tiles.binStart);
+    free(tiles.bins);
+  }
+
+  free(tiles.pxs);
+  free(tiles.pys);
+}
+void DrawScatterPlotDensity(RGBABitmapImage *canvas, ScatterPlotSeries *sp, double xMin, double xMax, double yMin, double yMax, double xPixelMin, double xPixelMax, double yPixelMin, double yPixelMax){
+  size_t i, width, height, cell, maxCount, *counts;
+  double x, y, logMax;
+  RGBA color;
+
+  /* Bin the points into one count per pixel, so the drawing below depends on the canvas size and not on the number of points */
+  width = canvas->xLength;
+  height = canvas->yLength;
+  counts = (size_t *)calloc(width*height, sizeof(size_t));
+  if(counts == NULL){
+    return;
+  }
+
+  maxCount = 0;
+  for(i = 0; i < sp->xsLength; i = i + 1){
+    x = sp->xs[i];
+    y = sp->ys[i];
+
+    if(x > xMin && x < xMax && y > yMin && y < yMax){
+      x = floor(MapXCoordinate(x, xMin, xMax, xPixelMin, xPixelMax));
+      y = floor(MapYCoordinate(y, yMin, yMax, yPixelMin, yPixelMax));
+
+      if(x >= 0.0 && x < width && y >= 0.0 && y < height){
+        cell = (size_t)y*width + (size_t)x;
+        counts[cell] = counts[cell] + 1;
+        if(counts[cell] > maxCount){
+          maxCount = counts[cell];
+        }
+      }
+    }
+  }
+
+  /* Colour map: the series colour, with an opacity growing with the log of the count */
+  color = *sp->color;
+  logMax = log(1.0 + maxCount);
+  for(cell = 0; cell < width*height; cell = cell + 1){
+    if(counts[cell] > 0){
+      color.a = sp->color->a*(DENSITY_MIN_ALPHA + (1.0 - DENSITY_MIN_ALPHA)*log(1.0 + counts[cell])/logMax);
+      DrawPixel(canvas, cell % width, cell/width, &color);
+    }
+  }
+
+  free(counts);
+}
 _Bool ScatterPlotFromSettingsValid(ScatterPlotSettings *settings){
   _Bool success, found;
   ScatterPlotSeries *series;
@@ -990,6 +1187,8 @@ _Bool ScatterPlotFromSettingsValid(ScatterPlotSettings *settings){
         found = true;
       }else if(aStringsEqual(series->pointType, series->pointTypeLength, strparam(L"pixels"))){
         found = true;
+      }else if(aStringsEqual(series->pointType, series->pointTypeLength, strparam(L"density"))){
+        found = true;
       }
       if( !found ){
         success = false;
@@ -1522,87 +1721,101 @@ RGBA *CreateRGBAColor(double r, double g, double b, double a){
   color->b = b;
   return color;
 }
+static unsigned char *PixelAt(RGBABitmapImage *image, double x, double y){
+  return image->pixels + 4*((size_t)y*image->xLength + (size_t)x);
+}
+static unsigned char ChannelToByte(double c){
+  return (unsigned char)Round(fmax(0.0, fmin(1.0, c))*255.0);
+}
 RGBABitmapImage *CreateImage(double w, double h, RGBA *color){
   RGBABitmapImage *image;
-  double i, j;
+  unsigned char packed[4];
+  size_t i, pixels;
 
   image = (RGBABitmapImage *)malloc(sizeof(RGBABitmapImage));
-  image->x = (RGBABitmap**)malloc(sizeof(RGBABitmap) * w);
   image->xLength = w;
-  for(i = 0.0; i < w; i = i + 1.0){
-    image->x[(int)(i)] = (RGBABitmap *)malloc(sizeof(RGBABitmap));
-    image->x[(int)(i)]->y = (RGBA**)malloc(sizeof(RGBA) * h);
-    image->x[(int)(i)]->yLength = h;
-    for(j = 0.0; j < h; j = j + 1.0){
-      image->x[(int)(i)]->y[(int)(j)] = (RGBA *)malloc(sizeof(RGBA));
-      SetPixel(image, i, j, color);
-    }
+  image->yLength = w > 0.0 ? h : 0.0;
+  ResetImageClip(image);
+  pixels = image->xLength*image->yLength;
+  /* One allocation for the whole canvas */
+  image->pixels = (unsigned char*)malloc(4*pixels + 4);
+
+  packed[0] = ChannelToByte(color->r);
+  packed[1] = ChannelToByte(color->g);
+  packed[2] = ChannelToByte(color->b);
+  packed[3] = ChannelToByte(color->a);
+  for(i = 0; i < pixels; i++){
+    memcpy(image->pixels + 4*i, packed, 4);
   }
 
   return image;
 }
 void DeleteImage(RGBABitmapImage *image){
-  double i, j, w, h;
-
-  w = ImageWidth(image);
-  h = ImageHeight(image);
-
-  for(i = 0.0; i < w; i = i + 1.0){
-    for(j = 0.0; j < h; j = j + 1.0){
-      free(image->x[(int)(i)]->y[(int)(j)]);
-    }
-    free(image->x[(int)(i)]);
-  }
+  free(image->pixels);
   free(image);
 }
+void ResetImageClip(RGBABitmapImage *image){
+  image->clipX0 = 0;
+  image->clipY0 = 0;
+  image->clipX1 = image->xLength;
+  image->clipY1 = image->yLength;
+}
 double ImageWidth(RGBABitmapImage *image){
   return image->xLength;
 }
 double ImageHeight(RGBABitmapImage *image){
-  double height;
-
-  if(ImageWidth(image) == 0.0){
-    height = 0.0;
-  }else{
-    height = image->x[0]->yLength;
-  }
-
-  return height;
+  return image->yLength;
 }
 void SetPixel(RGBABitmapImage *image, double x, double y, RGBA *color){
-  if(x >= 0.0 && x < ImageWidth(image) && y >= 0.0 && y < ImageHeight(image)){
-    image->x[(int)(x)]->y[(int)(y)]->a = color->a;
-    image->x[(int)(x)]->y[(int)(y)]->r = color->r;
-    image->x[(int)(x)]->y[(int)(y)]->g = color->g;
-    image->x[(int)(x)]->y[(int)(y)]->b = color->b;
+  unsigned char *pixel;
+
+  if(x >= image->clipX0 && x < image->clipX1 && y >= image->clipY0 && y < image->clipY1){
+    pixel = PixelAt(image, x, y);
+    pixel[0] = ChannelToByte(color->r);
+    pixel[1] = ChannelToByte(color->g);
+    pixel[2] = ChannelToByte(color->b);
+    pixel[3] = ChannelToByte(color->a);
   }
 }
 void DrawPixel(RGBABitmapImage *image, double x, double y, RGBA *color){
   double ra, ga, ba, aa;
   double rb, gb, bb, ab;
   double ro, go, bo, ao;
+  unsigned char *pixel;
+
+  if(x >= image->clipX0 && x < image->clipX1 && y >= image->clipY0 && y < image->clipY1){
+    pixel = PixelAt(image, x, y);
+
+    /* An opaque colour replaces the pixel, so there is nothing to blend */
+    if(color->a >= 1.0){
+      SetPixel(image, x, y, color);
+      return;
+    }
 
-  if(x >= 0.0 && x < ImageWidth(image) && y >= 0.0 && y < ImageHeight(image)){
     ra = color->r;
     ga = color->g;
     ba = color->b;
     aa = color->a;
 
-    rb = image->x[(int)(x)]->y[(int)(y)]->r;
-    gb = image->x[(int)(x)]->y[(int)(y)]->g;
-    bb = image->x[(int)(x)]->y[(int)(y)]->b;
-    ab = image->x[(int)(x)]->y[(int)(y)]->a;
+    rb = pixel[0]/255.0;
+    gb = pixel[1]/255.0;
+    bb = pixel[2]/255.0;
+    ab = pixel[3]/255.0;
 
     ao = CombineAlpha(aa, ab);
 
-    ro = AlphaBlend(ra, aa, rb, ab, ao);
-    go = AlphaBlend(ga, aa, gb, ab, ao);
-    bo = AlphaBlend(ba, aa, bb, ab, ao);
+    if(ao > 0.0){
+      ro = AlphaBlend(ra, aa, rb, ab, ao);
+      go = AlphaBlend(ga, aa, gb, ab, ao);
+      bo = AlphaBlend(ba, aa, bb, ab, ao);
+    }else{
+      ro = go = bo = 0.0;
+    }
 
-    image->x[(int)(x)]->y[(int)(y)]->r = ro;
-    image->x[(int)(x)]->y[(int)(y)]->g = go;
-    image->x[(int)(x)]->y[(int)(y)]->b = bo;
-    image->x[(int)(x)]->y[(int)(y)]->a = ao;
+    pixel[0] = ChannelToByte(ro);
+    pixel[1] = ChannelToByte(go);
+    pixel[2] = ChannelToByte(bo);
+    pixel[3] = ChannelToByte(ao);
   }
 }
 double CombineAlpha(double as, double ad){
@@ -1633,11 +1846,13 @@ void DrawRectangle1px(RGBABitmapImage *image, double x, double y, double width,
 }
 void DrawImageOnImage(RGBABitmapImage *dst, RGBABitmapImage *src, double topx, double topy){
   double y, x;
+  RGBA color;
 
   for(y = 0.0; y < ImageHeight(src); y = y + 1.0){
     for(x = 0.0; x < ImageWidth(src); x = x + 1.0){
       if(topx + x >= 0.0 && topx + x < ImageWidth(dst) && topy + y >= 0.0 && topy + y < ImageHeight(dst)){
-        DrawPixel(dst, topx + x, topy + y, src->x[(int)(x)]->y[(int)(y)]);
+        GetImagePixelInto(src, x, y, &color);
+        DrawPixel(dst, topx + x, topy + y, &color);
       }
     }
   }
@@ -1798,46 +2013,42 @@ void CubicBezierPoint(double x0, double y0, double c0x, double c0y, double c1x,
 }
 RGBABitmapImage *CopyImage(RGBABitmapImage *image){
   RGBABitmapImage *copy;
-  double i, j;
 
   copy = CreateImage(ImageWidth(image), ImageHeight(image), GetTransparent());
-
-  for(i = 0.0; i < ImageWidth(image); i = i + 1.0){
-    for(j = 0.0; j < ImageHeight(image); j = j + 1.0){
-      SetPixel(copy, i, j, image->x[(int)(i)]->y[(int)(j)]);
-    }
-  }
+  memcpy(copy->pixels, image->pixels, 4*image->xLength*image->yLength);
 
   return copy;
 }
+void GetImagePixelInto(RGBABitmapImage *image, double x, double y, RGBA *out){
+  unsigned char *pixel;
+
+  pixel = PixelAt(image, x, y);
+  out->r = pixel[0]/255.0;
+  out->g = pixel[1]/255.0;
+  out->b = pixel[2]/255.0;
+  out->a = pixel[3]/255.0;
+}
 RGBA *GetImagePixel(RGBABitmapImage *image, double x, double y){
-  return image->x[(int)(x)]->y[(int)(y)];
+  RGBA *color;
+
+  /* A new colour like CreateRGBAColor(), so every result can be kept; GetImagePixelInto() allocates nothing */
+  color = (RGBA *)malloc(sizeof(RGBA));
+  GetImagePixelInto(image, x, y, color);
+
+  return color;
 }
 void HorizontalFlip(RGBABitmapImage *img){
   double y, x;
-  double tmp;
-  RGBA *c1, *c2;
+  unsigned char tmp[4], *c1, *c2;
 
   for(y = 0.0; y < ImageHeight(img); y = y + 1.0){
-    for(x = 0.0; x < ImageWidth(img)/2.0; x = x + 1.0){
-      c1 = img->x[(int)(x)]->y[(int)(y)];
-      c2 = img->x[(int)(ImageWidth(img) - 1.0 - x)]->y[(int)(y)];
-
-      tmp = c1->a;
-      c1->a = c2->a;
-      c2->a = tmp;
-
-      tmp = c1->r;
-      c1->r = c2->r;
-      c2->r = tmp;
+    for(x = 0.0; x < floor(ImageWidth(img)/2.0); x = x + 1.0){
+      c1 = PixelAt(img, x, y);
+      c2 = PixelAt(img, ImageWidth(img) - 1.0 - x, y);
 
-      tmp = c1->g;
-      c1->g = c2->g;
-      c2->g = tmp;
-
-      tmp = c1->b;
-      c1->b = c2->b;
-      c2->b = tmp;
+      memcpy(tmp, c1, 4);
+      memcpy(c1, c2, 4);
+      memcpy(c2, tmp, 4);
     }
   }
 }
@@ -1853,12 +2064,14 @@ void DrawFilledRectangle(RGBABitmapImage *image, double x, double y, double w, d
 RGBABitmapImage *RotateAntiClockwise90Degrees(RGBABitmapImage *image){
   RGBABitmapImage *rotated;
   double x, y;
+  RGBA color;
 
   rotated = CreateImage(ImageHeight(image), ImageWidth(image), GetBlack());
 
   for(y = 0.0; y < ImageHeight(image); y = y + 1.0){
     for(x = 0.0; x < ImageWidth(image); x = x + 1.0){
-      SetPixel(rotated, y, ImageWidth(image) - 1.0 - x, GetImagePixel(image, x, y));
+      GetImagePixelInto(image, x, y, &color);
+      SetPixel(rotated, y, ImageWidth(image) - 1.0 - x, &color);
     }
   }
 
@@ -2320,9 +2533,10 @@ RGBA *CreateBlurForPoint(RGBABitmapImage *src, double x, double y, double pixels
   double fromx, tox, fromy, toy;
   double w, h;
   double alpha;
+  unsigned char *pixel;
 
   w = src->xLength;
-  h = src->x[0]->yLength;
+  h = src->yLength;
 
   rgba = (RGBA *)malloc(sizeof(RGBA));
   rgba->r = 0.0;
@@ -2346,11 +2560,12 @@ RGBA *CreateBlurForPoint(RGBABitmapImage *src, double x, double y, double pixels
   countTransparent = 0.0;
   for(i = fromx; i < tox; i = i + 1.0){
     for(j = fromy; j < toy; j = j + 1.0){
-      alpha = src->x[(int)(i)]->y[(int)(j)]->a;
+      pixel = PixelAt(src, i, j);
+      alpha = pixel[3]/255.0;
       if(alpha > 0.0){
-        rgba->r = rgba->r + src->x[(int)(i)]->y[(int)(j)]->r;
-        rgba->g = rgba->g + src->x[(int)(i)]->y[(int)(j)]->g;
-        rgba->b = rgba->b + src->x[(int)(i)]->y[(int)(j)]->b;
+        rgba->r = rgba->r + pixel[0]/255.0;
+        rgba->g = rgba->g + pixel[1]/255.0;
+        rgba->b = rgba->b + pixel[2]/255.0;
         countColor = countColor + 1.0;
       }
       rgba->a = rgba->a + alpha;
@@ -3987,27 +4202,23 @@ PHYS *PysicsHeader(double pixelsPerMeter){
   return phys;
 }
 double *ConvertToPNGWithOptions(size_t *returnArrayLength, RGBABitmapImage *image, double colorType, _Bool setPhys, double pixelsPerMeter, double compressionLevel){
-  PNGImage *png;
-  double *pngData, *colorData;
-  size_t pngDataLength, colorDataLength;
-
-  png = (PNGImage *)malloc(sizeof(PNGImage));
-
-  png->signature = PNGSignature(&png->signatureLength);
+  PngOptions options;
+  unsigned char *png;
+  double *pngData;
+  size_t pngDataLength, i;
 
-  png->ihdr = PNGHeader(image, colorType);
+  /* Encoded by the byte-native encoder in png.c, see png.h for what the compression levels do */
+  options.color_type = colorType == 6.0 ? PNG_COLOR_RGBA : PNG_COLOR_GREYSCALE;
+  options.level = compressionLevel;
+  options.set_phys = setPhys;
+  options.pixels_per_meter = pixelsPerMeter;
+  png = png_encode_with_options(image, &options, &pngDataLength);
 
-  png->physPresent = setPhys;
-  png->phys = PysicsHeader(pixelsPerMeter);
-
-  if(colorType == 6.0){
-    colorData = GetPNGColorData(&colorDataLength, image);
-  }else{
-    colorData = GetPNGColorDataGreyscale(&colorDataLength, image);
+  pngData = (double*)malloc(sizeof(double) * (pngDataLength));
+  for(i = 0; i < pngDataLength; i++){
+    pngData[i] = png[i];
   }
-  png->zlibStruct = ZLibCompressStaticHuffman(colorData, colorDataLength, compressionLevel);
-
-  pngData = PNGSerializeChunks(&pngDataLength, png);
+  free(png);
 
   *returnArrayLength = pngDataLength;
   return pngData;
@@ -4088,7 +4299,7 @@ double *GetPNGColorData(size_t *returnArrayLength, RGBABitmapImage *image){
   double *colordata;
   size_t colordataLength;
   double length, x, y, next;
-  RGBA *rgba;
+  unsigned char *pixel;
 
   length = 4.0*ImageWidth(image)*ImageHeight(image) + ImageHeight(image);
 
@@ -4101,14 +4312,14 @@ double *GetPNGColorData(size_t *returnArrayLength, RGBABitmapImage *image){
     colordata[(int)(next)] = 0.0;
     next = next + 1.0;
     for(x = 0.0; x < ImageWidth(image); x = x + 1.0){
-      rgba = image->x[(int)(x)]->y[(int)(y)];
-      colordata[(int)(next)] = Round(rgba->r*255.0);
+      pixel = PixelAt(image, x, y);
+      colordata[(int)(next)] = pixel[0];
       next = next + 1.0;
-      colordata[(int)(next)] = Round(rgba->g*255.0);
+      colordata[(int)(next)] = pixel[1];
       next = next + 1.0;
-      colordata[(int)(next)] = Round(rgba->b*255.0);
+      colordata[(int)(next)] = pixel[2];
       next = next + 1.0;
-      colordata[(int)(next)] = Round(rgba->a*255.0);
+      colordata[(int)(next)] = pixel[3];
       next = next + 1.0;
     }
   }
@@ -4120,7 +4331,7 @@ double *GetPNGColorDataGreyscale(size_t *returnArrayLength, RGBABitmapImage *ima
   double *colordata;
   size_t colordataLength;
   double length, x, y, next;
-  RGBA *rgba;
+  unsigned char *pixel;
 
   length = ImageWidth(image)*ImageHeight(image) + ImageHeight(image);
 
@@ -4133,8 +4344,8 @@ double *GetPNGColorDataGreyscale(size_t *returnArrayLength, RGBABitmapImage *ima
     colordata[(int)(next)] = 0.0;
     next = next + 1.0;
     for(x = 0.0; x < ImageWidth(image); x = x + 1.0){
-      rgba = image->x[(int)(x)]->y[(int)(y)];
-      colordata[(int)(next)] = Round(rgba->r*255.0);
+      pixel = PixelAt(image, x, y);
+      colordata[(int)(next)] = pixel[0];
       next = next + 1.0;
     }
   }
@@ -4233,8 +4444,10 @@ _Bool PNGReadHeader(RGBABitmapImage *image, Chunk **cs, size_t csLength, StringR
       ihdr->InterlaceMethod = ReadByte(c->data, c->dataLength, position);
 
       n = CreateImage(ihdr->Width, ihdr->Height, GetTransparent());
-      image->x = n->x;
+      image->pixels = n->pixels;
       image->xLength = n->xLength;
+      image->yLength = n->yLength;
+      ResetImageClip(image);
 
       if(ihdr->ColourType == 6.0){
         if(ihdr->BitDepth == 8.0){
@@ -4845,32 +5058,22 @@ double UpdateCRC32(double crc, double *buf, size_t bufLength, double *crc_table,
   return crc;
 }
 double CalculateCRC32(double *buf, size_t bufLength){
-  double *crcTable;
-  size_t crcTableLength;
-  double b32max, value;
-
-  crcTable = MakeCRC32Table(&crcTableLength);
-
-  b32max = pow(2.0, 32.0) - 1.0;
-  value = UpdateCRC32(b32max, buf, bufLength, crcTable, crcTableLength);
-
-  return Xor4Byte(value, b32max);
+  return CRC32OfInterval(buf, bufLength, 0.0, bufLength);
 }
 double CRC32OfInterval(double *data, size_t dataLength, double from, double length){
-  double *crcBase;
-  size_t crcBaseLength;
-  double i, crc;
-
-  crcBase = (double*)malloc(sizeof(double) * (length));
-  crcBaseLength = length;
+  unsigned char *bytes;
+  size_t i;
+  double crc;
 
-  for(i = 0.0; i < length; i = i + 1.0){
-    crcBase[(int)(i)] = data[(int)(from + i)];
+  /* png_crc32() keeps its tables between calls and runs on bytes */
+  bytes = (unsigned char*)malloc((size_t)length + 1);
+  for(i = 0; i < (size_t)length; i++){
+    bytes[i] = data[(size_t)from + i];
   }
 
-  crc = CalculateCRC32(crcBase, crcBaseLength);
+  crc = png_crc32(0, bytes, (size_t)length);
 
-  free(crcBase);
+  free(bytes);
 
   return crc;
 }
@@ -6308,91 +6511,122 @@ double Read2bytesByteBoundary(double *data, size_t dataLength, NumberReference *
   return r;
 }
 double ComputeAdler32(double *data, size_t dataLength){
-  double a, b, m, i;
-
-  a = 1.0;
-  b = 0.0;
-  m = 65521.0;
+  unsigned char *bytes;
+  size_t i;
+  double adler;
 
-  for(i = 0.0; i < dataLength; i = i + 1.0){
-    a = fmod(a + data[(int)(i)], m);
-    b = fmod(b + a, m);
+  bytes = (unsigned char*)malloc(dataLength + 1);
+  for(i = 0; i < dataLength; i++){
+    bytes[i] = data[i];
   }
 
-  return b*pow(2.0, 16.0) + a;
+  adler = png_adler32(1, bytes, dataLength);
+
+  free(bytes);
+
+  return adler;
 }
 double *DeflateDataStaticHuffman(size_t *returnArrayLength, double *data, size_t dataLength, double level){
+  ByteBuffer compressed = {NULL, 0, 0};
+  unsigned char *input;
   double *bytes;
-  size_t bytesLength;
-  NumberReference *currentBit;
-  double i;
-  NumberArrayReference *copy;
-  NumberReference *code, *length, *compressedCode, *lengthAdditionLength, *distanceCode;
-  NumberReference *distanceReference, *lengthReference, *lengthAddition;
-  NumberReference *distanceAdditionReference, *distanceAdditionLengthReference;
-  double *bitReverseLookupTable;
-  size_t bitReverseLookupTableLength;
-  BooleanReference *match;
-
-  code = CreateNumberReference(0.0);
-  length = CreateNumberReference(0.0);
-  compressedCode = CreateNumberReference(0.0);
-  lengthAdditionLength = CreateNumberReference(0.0);
-  distanceCode = CreateNumberReference(0.0);
-  distanceReference = CreateNumberReference(0.0);
-  lengthReference = CreateNumberReference(0.0);
-  lengthAddition = CreateNumberReference(0.0);
-  distanceAdditionReference = CreateNumberReference(0.0);
-  distanceAdditionLengthReference = CreateNumberReference(0.0);
-  match = (BooleanReference *)malloc(sizeof(BooleanReference));
-
-  bytes = (double*)malloc(sizeof(double) * (fmax(dataLength*2.0, 100.0)));
-  bytesLength = fmax(dataLength*2.0, 100.0);
-  aFillNumberArray(bytes, bytesLength, 0.0);
-  currentBit = CreateNumberReference(0.0);
-
-  bitReverseLookupTable = GenerateBitReverseLookupTable(&bitReverseLookupTableLength, 9.0);
-
-  /* Final block */
-  AppendBitsToBytesRight(bytes, bytesLength, currentBit, 1.0, 1.0);
-  /* Fixed code */
-  AppendBitsToBytesRight(bytes, bytesLength, currentBit, 1.0, 2.0);
-
-  for(i = 0.0; i < dataLength; ){
-    FindMatch(data, dataLength, i, distanceReference, lengthReference, match, level);
-
-    if(match->booleanValue){
-      GetDeflateLengthCode(lengthReference->numberValue, compressedCode, lengthAddition, lengthAdditionLength);
-      GetDeflateDistanceCode(distanceReference->numberValue, distanceCode, distanceAdditionReference, distanceAdditionLengthReference, bitReverseLookupTable, bitReverseLookupTableLength);
-    }
-
-    if( !match->booleanValue ){
-      GetDeflateStaticHuffmanCode(data[(int)(i)], code, length, bitReverseLookupTable, bitReverseLookupTableLength);
-      AppendBitsToBytesRight(bytes, bytesLength, currentBit, code->numberValue, length->numberValue);
-      i = i + 1.0;
-    }else{
-      GetDeflateStaticHuffmanCode(compressedCode->numberValue, code, length, bitReverseLookupTable, bitReverseLookupTableLength);
-      AppendBitsToBytesRight(bytes, bytesLength, currentBit, code->numberValue, length->numberValue);
-      AppendBitsToBytesRight(bytes, bytesLength, currentBit, lengthAddition->numberValue, lengthAdditionLength->numberValue);
-      AppendBitsToBytesRight(bytes, bytesLength, currentBit, distanceCode->numberValue, 5.0);
-      AppendBitsToBytesRight(bytes, bytesLength, currentBit, distanceAdditionReference->numberValue, distanceAdditionLengthReference->numberValue);
-      i = i + lengthReference->numberValue;
-    }
+  size_t i;
+
+  /* The byte-native encoder in png.c does the work */
+  input = (unsigned char*)malloc(dataLength + 1);
+  for(i = 0; i < dataLength; i++){
+    input[i] = data[i];
   }
+  png_deflate(&compressed, input, dataLength, level, PNG_BLOCK_STATIC);
 
-  /* Stop symbol */
-  GetDeflateStaticHuffmanCode(256.0, code, length, bitReverseLookupTable, bitReverseLookupTableLength);
-  AppendBitsToBytesRight(bytes, bytesLength, currentBit, code->numberValue, length->numberValue);
+  bytes = (double*)malloc(sizeof(double) * (compressed.length + 1));
+  for(i = 0; i < compressed.length; i++){
+    bytes[i] = compressed.data[i];
+  }
 
-  copy = (NumberArrayReference *)malloc(sizeof(NumberArrayReference));
-  aCopyNumberArrayRange(bytes, bytesLength, 0.0, ceil(currentBit->numberValue/8.0), copy);
-  free(bytes);
-  bytes = copy->numberArray;
-  bytesLength = copy->numberArrayLength;
+  free(compressed.data);
+  free(input);
 
-  *returnArrayLength = bytesLength;
+  *returnArrayLength = compressed.length;
   return bytes;
 }
+LZ77Matcher *CreateLZ77Matcher(double level){
+  LZ77Matcher *matcher;
+  int i;
+
+  matcher = (LZ77Matcher *)malloc(sizeof(LZ77Matcher));
+  matcher->head = (int*)malloc(sizeof(int) * (1 << LZ77_HASH_BITS));
+  matcher->prev = (int*)malloc(sizeof(int) * LZ77_WINDOW_SIZE);
+  for(i = 0; i < (1 << LZ77_HASH_BITS); i++){
+    matcher->head[i] = -1;
+  }
+
+  /* The level keeps its old 0 to 10 scale, now trading chain length instead of window size */
+  level = fmax(0.0, fmin(10.0, level));
+  matcher->maxChain = LZ77_MIN_CHAIN + (int)(level/10.0*(LZ77_MAX_CHAIN - LZ77_MIN_CHAIN));
+
+  return matcher;
+}
+void FreeLZ77Matcher(LZ77Matcher *matcher){
+  free(matcher->head);
+  free(matcher->prev);
+  free(matcher);
+}
+static int LZ77Hash(unsigned char *data, size_t pos){
+  unsigned int key;
+
+  key = ((unsigned int)data[pos] << 16) | ((unsigned int)data[pos + 1] << 8) | data[pos + 2];
+  return (int)((key*2654435761u) >> (32 - LZ77_HASH_BITS));
+}
+void LZ77Insert(LZ77Matcher *matcher, unsigned char *data, size_t dataLength, size_t pos){
+  int hash;
+
+  if(pos + LZ77_MIN_MATCH <= dataLength){
+    hash = LZ77Hash(data, pos);
+    matcher->prev[pos & (LZ77_WINDOW_SIZE - 1)] = matcher->head[hash];
+    matcher->head[hash] = (int)pos;
+  }
+}
+int LZ77LongestMatch(LZ77Matcher *matcher, unsigned char *data, size_t dataLength, size_t pos, int *distance){
+  int candidate, previous, chain, bestLength, maxLength, matchLength;
+  unsigned char *current, *earlier;
+
+  if(pos + LZ77_MIN_MATCH > dataLength){
+    return 0;
+  }
+
+  maxLength = (int)fmin(dataLength - pos, LZ77_MAX_MATCH);
+  current = data + pos;
+  bestLength = 0;
+  *distance = 0;
+
+  candidate = matcher->head[LZ77Hash(data, pos)];
+  for(chain = matcher->maxChain; candidate >= 0 && pos - candidate <= LZ77_WINDOW_SIZE && chain > 0; chain--){
+    earlier = data + candidate;
+
+    /* A candidate can only beat the best match so far if it agrees on the byte just past it */
+    if(earlier[bestLength] == current[bestLength] && earlier[0] == current[0]){
+      for(matchLength = 0; matchLength < maxLength && earlier[matchLength] == current[matchLength]; matchLength++);
+
+      if(matchLength > bestLength){
+        bestLength = matchLength;
+        *distance = (int)(pos - candidate);
+        if(bestLength == maxLength){
+          break;
+        }
+      }
+    }
+
+    /* Slots of positions that left the window are reused, so stop once the chain stops going backwards */
+    previous = matcher->prev[candidate & (LZ77_WINDOW_SIZE - 1)];
+    if(previous >= candidate){
+      break;
+    }
+    candidate = previous;
+  }
+
+  return bestLength >= LZ77_MIN_MATCH ? bestLength : 0;
+}
 void FindMatch(double *data, size_t dataLength, double pos, NumberReference *distanceReference, NumberReference *lengthReference, BooleanReference *match, double level){
   double i, j;
   double deflateMinMength, deflateMaxLength, deflateMaxDistance;
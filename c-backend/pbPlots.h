@@ -4,6 +4,27 @@
 #include <string.h>
 #include <wchar.h>
 
+/* LZ77 parameters of the DEFLATE encoder */
+#define LZ77_WINDOW_SIZE 32768
+#define LZ77_HASH_BITS 15
+#define LZ77_MIN_MATCH 3
+#define LZ77_MAX_MATCH 258
+/* Hash chain positions compared per byte at compression level 0 and 10 */
+#define LZ77_MIN_CHAIN 8
+#define LZ77_MAX_CHAIN 4096
+/* Matches at least this long are taken at once instead of checking the next byte for a longer one */
+#define LZ77_LAZY_LENGTH 32
+
+/* Edge in pixels of the square tiles DrawScatterPlotPoints() draws in parallel, the fewest points
+   worth splitting over threads, and how far any point marker reaches from its centre pixel.
+   Only point markers are tiled; the line segments of a series are drawn serially. */
+#define SCATTER_TILE_SIZE 128
+#define SCATTER_TILE_MIN_POINTS 4096
+#define SCATTER_POINT_REACH 6
+
+/* Opacity of a pixel holding a single point when a series is drawn with the "density" point type; the fullest pixel is opaque */
+#define DENSITY_MIN_ALPHA 0.25
+
 struct RGBABitmapImageReference;
 typedef struct RGBABitmapImageReference RGBABitmapImageReference;
 
@@ -25,9 +46,6 @@ typedef struct BarPlotSettings BarPlotSettings;
 struct RGBA;
 typedef struct RGBA RGBA;
 
-struct RGBABitmap;
-typedef struct RGBABitmap RGBABitmap;
-
 struct RGBABitmapImage;
 typedef struct RGBABitmapImage RGBABitmapImage;
 
@@ -88,6 +106,9 @@ typedef struct LinkedListNodeCharacters LinkedListNodeCharacters;
 struct DynamicArrayNumbers;
 typedef struct DynamicArrayNumbers DynamicArrayNumbers;
 
+struct LZ77Matcher;
+typedef struct LZ77Matcher LZ77Matcher;
+
 struct RGBABitmapImageReference{
   RGBABitmapImage *image;
 };
@@ -183,14 +204,16 @@ struct RGBA{
   double a;
 };
 
-struct RGBABitmap{
-  RGBA **y;
-  size_t yLength;
-};
-
+/* A single contiguous framebuffer: row y starts at pixels + 4*xLength*y and every pixel is
+   four bytes in R, G, B, A order, the layout of a PNG scanline. Channels are stored as
+   round(255*c); SetPixel(), DrawPixel(), GetImagePixel() and GetImagePixelInto() convert from and to RGBA. */
 struct RGBABitmapImage{
-  RGBABitmap **x;
+  unsigned char *pixels;
   size_t xLength;
+  size_t yLength;
+  /* SetPixel() and DrawPixel() only touch x in [clipX0, clipX1) and y in [clipY0, clipY1),
+     the whole image unless a tile of it is being drawn by DrawScatterPlotPoints(). */
+  size_t clipX0, clipY0, clipX1, clipY1;
 };
 
 struct BooleanArrayReference{
@@ -270,6 +293,15 @@ struct ZLIBStruct{
   double Adler32CheckValue;
 };
 
+/* Hash chains over the last 32 KB of input: head holds the most recent position for each
+   hash of three bytes and prev links every position in the window to the one before it with
+   the same hash, so only positions that can start a match are ever compared. */
+struct LZ77Matcher{
+  int *head;
+  int *prev;
+  int maxChain;
+};
+
 struct LinkedListNodeStrings{
   _Bool end;
   wchar_t *value;
@@ -339,6 +371,9 @@ ScatterPlotSettings *GetDefaultScatterPlotSettings();
 ScatterPlotSeries *GetDefaultScatterPlotSeriesSettings();
 void DrawScatterPlot(RGBABitmapImageReference *canvasReference, double width, double height, double *xs, size_t xsLength, double *ys, size_t ysLength);
 _Bool DrawScatterPlotFromSettings(RGBABitmapImageReference *canvasReference, ScatterPlotSettings *settings);
+void DrawScatterPlotPoint(RGBABitmapImage *canvas, double x, double y, wchar_t *pointType, size_t pointTypeLength, RGBA *color);
+void DrawScatterPlotPoints(RGBABitmapImage *canvas, ScatterPlotSeries *sp, double xMin, double xMax, double yMin, double yMax, double xPixelMin, double xPixelMax, double yPixelMin, double yPixelMax, double threads);
+void DrawScatterPlotDensity(RGBABitmapImage *canvas, ScatterPlotSeries *sp, double xMin, double xMax, double yMin, double yMax, double xPixelMin, double xPixelMax, double yPixelMin, double yPixelMax);
 _Bool ScatterPlotFromSettingsValid(ScatterPlotSettings *settings);
 
 BarPlotSettings *GetDefaultBarPlotSettings();
@@ -363,6 +398,7 @@ RGBA *CreateRGBAColor(double r, double g, double b, double a);
 
 RGBABitmapImage *CreateImage(double w, double h, RGBA *color);
 void DeleteImage(RGBABitmapImage *image);
+void ResetImageClip(RGBABitmapImage *image);
 double ImageWidth(RGBABitmapImage *image);
 double ImageHeight(RGBABitmapImage *image);
 void SetPixel(RGBABitmapImage *image, double x, double y, RGBA *color);
@@ -384,6 +420,7 @@ void DrawCubicBezierCurve(RGBABitmapImage *image, double x0, double y0, double c
 void CubicBezierPoint(double x0, double y0, double c0x, double c0y, double c1x, double c1y, double x1, double y1, double t, NumberReference *x, NumberReference *y);
 RGBABitmapImage *CopyImage(RGBABitmapImage *image);
 RGBA *GetImagePixel(RGBABitmapImage *image, double x, double y);
+void GetImagePixelInto(RGBABitmapImage *image, double x, double y, RGBA *out);
 void HorizontalFlip(RGBABitmapImage *img);
 void DrawFilledRectangle(RGBABitmapImage *image, double x, double y, double w, double h, RGBA *color);
 RGBABitmapImage *RotateAntiClockwise90Degrees(RGBABitmapImage *image);
@@ -729,6 +766,10 @@ double ComputeAdler32(double *data, size_t dataLength);
 
 double *DeflateDataStaticHuffman(size_t *returnArrayLength, double *data, size_t dataLength, double level);
 void FindMatch(double *data, size_t dataLength, double pos, NumberReference *distanceReference, NumberReference *lengthReference, BooleanReference *match, double level);
+LZ77Matcher *CreateLZ77Matcher(double level);
+void FreeLZ77Matcher(LZ77Matcher *matcher);
+void LZ77Insert(LZ77Matcher *matcher, unsigned char *data, size_t dataLength, size_t pos);
+int LZ77LongestMatch(LZ77Matcher *matcher, unsigned char *data, size_t dataLength, size_t pos, int *distance);
 double *GenerateBitReverseLookupTable(size_t *returnArrayLength, double bits);
 double ReverseBits(double x, double bits);
 double *DeflateDataNoCompression(size_t *returnArrayLength, double *data, size_t dataLength);
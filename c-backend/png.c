@@ -0,0 +1,923 @@
+// Byte-native PNG encoder for the plots drawn with pbPlots
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pbPlots.h"
+#include "png.h"
+#include "simd.h"
+
+/* pbPlots builds a PNG as an array of doubles, one per byte, and then copies it into a
+   byte array to write it out. This encoder works on uint8_t from the pixels to the file:
+   the scanlines are read straight out of the image, compressed into a growable byte
+   buffer, and every chunk is handed to a write callback together with its CRC, so the
+   file is written with a few fwrite()/write() calls and no double-per-byte copy.
+*/
+
+static const uint8_t png_signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+// DEFLATE length symbols 257..285 and distance symbols 0..29: first value and number of extra bits
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                         35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                           513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                           8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Tables filled in once by init_tables()
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint8_t length_symbol[259];       // match length -> index into length_base
+static uint8_t distance_symbol[32769];   // match distance -> distance symbol
+static uint16_t static_literal_codes[288];
+static uint8_t static_literal_lengths[288];
+static uint16_t static_distance_codes[30];
+static uint8_t static_distance_lengths[30];
+
+// Called by the DEFLATE writer with the whole bytes of out after every finished block, see deflate_blocks()
+typedef void (*BlockFlush)(ByteBuffer *out, void *ctx);
+
+// Bit writer over a byte buffer: DEFLATE packs bits starting from the least significant bit
+// Once the buffer cannot grow, failed is set and everything written after it is dropped
+typedef struct BitWriter {
+    ByteBuffer *out;
+    uint64_t bits;
+    int count;
+    int failed;
+} BitWriter;
+
+// Make room for at least `extra` more bytes, doubling the capacity when the buffer has to grow
+// Returns 0 on success and -1 if the memory could not be allocated, leaving the buffer as it was
+int byte_buffer_reserve(ByteBuffer *buffer, size_t extra) {
+    size_t new_capacity = buffer->capacity;
+    uint8_t *data;
+
+    if (buffer->length + extra <= buffer->capacity) {
+        return 0;
+    }
+
+    if (new_capacity < 4096) {
+        new_capacity = 4096;
+    }
+    while (new_capacity < buffer->length + extra) {
+        new_capacity *= 2;
+    }
+
+    data = (uint8_t*)realloc(buffer->data, new_capacity);
+    if (data == NULL) {
+        printf("ERROR in png encoding. Could not allocate %zu bytes\n", new_capacity);
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = new_capacity;
+    return 0;
+}
+
+// Append length bytes to the end of the buffer, returns 0 on success and -1 if it could not grow
+int byte_buffer_append(ByteBuffer *buffer, const uint8_t *data, size_t length) {
+    if (byte_buffer_reserve(buffer, length) != 0) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+// Make room for extra more bytes in the output of writer, returns 0 if there is room
+static int writer_reserve(BitWriter *writer, size_t extra) {
+    if (!writer->failed && byte_buffer_reserve(writer->out, extra) != 0) {
+        writer->failed = 1;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+// Turn code lengths into canonical Huffman codes (RFC 1951 3.2.2), bit reversed for the LSB first bit writer
+static void canonical_codes(const uint8_t *lengths, int count, uint16_t *codes) {
+    int length_count[16] = {0}, next_code[16], i, bit, code = 0;
+
+    for (i = 0; i < count; i++) {
+        length_count[lengths[i]]++;
+    }
+    length_count[0] = 0;
+    for (bit = 1; bit < 16; bit++) {
+        code = (code + length_count[bit - 1]) << 1;
+        next_code[bit] = code;
+    }
+
+    for (i = 0; i < count; i++) {
+        int reversed = 0, value;
+        if (lengths[i] == 0) {
+            codes[i] = 0;
+            continue;
+        }
+        value = next_code[lengths[i]]++;
+        for (bit = 0; bit < lengths[i]; bit++) {
+            reversed = (reversed << 1) | ((value >> bit) & 1);
+        }
+        codes[i] = (uint16_t)reversed;
+    }
+}
+
+// Fill in the symbol and static Huffman tables
+static void init_tables(void) {
+    int i, symbol;
+
+    for (symbol = 0; symbol < 29; symbol++) {
+        for (i = length_base[symbol]; i < length_base[symbol] + (1 << length_extra[symbol]) && i <= 258; i++) {
+            length_symbol[i] = (uint8_t)symbol;
+        }
+    }
+    for (symbol = 0; symbol < 30; symbol++) {
+        for (i = distance_base[symbol]; i < distance_base[symbol] + (1 << distance_extra[symbol]) && i <= 32768; i++) {
+            distance_symbol[i] = (uint8_t)symbol;
+        }
+    }
+
+    // The fixed code of RFC 1951 3.2.6
+    for (i = 0; i < 288; i++) {
+        static_literal_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    for (i = 0; i < 30; i++) {
+        static_distance_lengths[i] = 5;
+    }
+    canonical_codes(static_literal_lengths, 288, static_literal_codes);
+    canonical_codes(static_distance_lengths, 30, static_distance_codes);
+}
+
+// Update a CRC-32 (as used by PNG and zlib's crc32()) with length more bytes, starting from crc = 0
+uint32_t png_crc32(uint32_t crc, const uint8_t *data, size_t length) {
+    return checksum_crc32(simd_level(), crc, data, length);
+}
+
+// Update an Adler-32 checksum with length more bytes, starting from adler = 1
+uint32_t png_adler32(uint32_t adler, const uint8_t *data, size_t length) {
+    return checksum_adler32(simd_level(), adler, data, length);
+}
+
+// Add the n lowest bits of value to the stream (n <= 32)
+static void put_bits(BitWriter *writer, uint32_t value, int n) {
+    writer->bits |= (uint64_t)value << writer->count;
+    writer->count += n;
+    if (writer->count >= 32) {
+        if (writer_reserve(writer, 4) != 0) {
+            writer->bits = 0;
+            writer->count = 0;
+            return;
+        }
+        writer->out->data[writer->out->length++] = (uint8_t)writer->bits;
+        writer->out->data[writer->out->length++] = (uint8_t)(writer->bits >> 8);
+        writer->out->data[writer->out->length++] = (uint8_t)(writer->bits >> 16);
+        writer->out->data[writer->out->length++] = (uint8_t)(writer->bits >> 24);
+        writer->bits >>= 32;
+        writer->count -= 32;
+    }
+}
+
+// Write out any bits left over, padding the last byte with zeros
+static void flush_bits(BitWriter *writer) {
+    while (writer->count > 0 && writer_reserve(writer, 4) == 0) {
+        writer->out->data[writer->out->length++] = (uint8_t)writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+    writer->bits = 0;
+    writer->count = 0;
+}
+
+// LZ77 parse with lazy matching from *pos until the input or max_symbols runs out
+// A literal is stored as its byte value and a match as length | distance << 9
+// Returns the number of symbols written to symbols and advances *pos past the bytes they cover
+static size_t lz77_parse(LZ77Matcher *matcher, const uint8_t *data, size_t length, size_t *pos,
+                         uint32_t *symbols, size_t max_symbols) {
+    uint8_t *input = (uint8_t*)data;
+    size_t i = *pos, count = 0;
+    int match_length, match_distance, next_length = 0, next_distance = 0, have_next = 0, k;
+
+    while (i < length && count < max_symbols) {
+        // Reuse the lookahead of the previous step when it was not taken
+        if (have_next) {
+            match_length = next_length;
+            match_distance = next_distance;
+            have_next = 0;
+        } else {
+            match_length = LZ77LongestMatch(matcher, input, length, i, &match_distance);
+        }
+        LZ77Insert(matcher, input, length, i);
+
+        // Lazy matching: emit a literal instead if a longer match starts at the next byte
+        if (match_length > 0 && match_length < LZ77_LAZY_LENGTH && i + 1 < length) {
+            next_length = LZ77LongestMatch(matcher, input, length, i + 1, &next_distance);
+            have_next = 1;
+            if (next_length > match_length) {
+                match_length = 0;
+            }
+        }
+
+        if (match_length == 0) {
+            symbols[count++] = data[i];
+            i++;
+        } else {
+            symbols[count++] = (uint32_t)match_length | (uint32_t)match_distance << 9;
+            // The bytes covered by the match can still start later matches
+            for (k = 1; k < match_length; k++) {
+                LZ77Insert(matcher, input, length, i + k);
+            }
+            i += match_length;
+            have_next = 0;
+        }
+    }
+
+    *pos = i;
+    return count;
+}
+
+// Write the symbols followed by the end of block symbol with the given literal/length and distance codes
+static void write_symbols(BitWriter *writer, const uint32_t *symbols, size_t count,
+                          const uint16_t *literal_codes, const uint8_t *literal_lengths,
+                          const uint16_t *distance_codes, const uint8_t *distance_lengths) {
+    size_t i;
+
+    // A match takes at most 15 + 5 + 15 + 13 bits, so 8 bytes per symbol always fit
+    if (writer_reserve(writer, count * 8 + 16) != 0) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        uint32_t length = symbols[i] & 0x1FF, distance = symbols[i] >> 9;
+
+        if (distance == 0) {
+            put_bits(writer, literal_codes[length], literal_lengths[length]);
+        } else {
+            int l = length_symbol[length], d = distance_symbol[distance];
+            put_bits(writer, literal_codes[257 + l], literal_lengths[257 + l]);
+            put_bits(writer, length - length_base[l], length_extra[l]);
+            put_bits(writer, distance_codes[d], distance_lengths[d]);
+            put_bits(writer, distance - distance_base[d], distance_extra[d]);
+        }
+    }
+
+    put_bits(writer, literal_codes[256], literal_lengths[256]);
+}
+
+// Huffman code lengths of at most max_bits for the count (<= 288) symbols with frequencies freq
+// Frequencies are halved until the tree is shallow enough, which costs little since it rarely happens
+static void huffman_lengths(const uint32_t *freq, int count, int max_bits, uint8_t *lengths) {
+    uint32_t weight[2 * 288], scaled[288];
+    int order[288], parent[2 * 288], depth[2 * 288];
+    int n = 0, i, j, next, leaf, node, deepest;
+
+    memset(lengths, 0, (size_t)count);
+    for (i = 0; i < count; i++) {
+        if (freq[i] > 0) {
+            scaled[n] = freq[i];
+            order[n++] = i;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    if (n == 1) {
+        lengths[order[0]] = 1;
+        return;
+    }
+
+    for (;;) {
+        // Sort the used symbols by weight (insertion sort, there are at most 288)
+        for (i = 1; i < n; i++) {
+            int symbol = order[i];
+            uint32_t w = scaled[i];
+            for (j = i - 1; j >= 0 && scaled[j] > w; j--) {
+                scaled[j + 1] = scaled[j];
+                order[j + 1] = order[j];
+            }
+            scaled[j + 1] = w;
+            order[j + 1] = symbol;
+        }
+
+        // Two queue Huffman construction: leaves in weight order, internal nodes in creation order
+        for (i = 0; i < n; i++) {
+            weight[i] = scaled[i];
+        }
+        leaf = 0;
+        node = n;
+        for (next = n; next < 2 * n - 1; next++) {
+            int pick[2];
+            for (j = 0; j < 2; j++) {
+                if (leaf < n && (node >= next || weight[leaf] <= weight[node])) {
+                    pick[j] = leaf++;
+                } else {
+                    pick[j] = node++;
+                }
+            }
+            weight[next] = weight[pick[0]] + weight[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = next;
+        }
+
+        depth[2 * n - 2] = 0;
+        deepest = 0;
+        for (i = 2 * n - 3; i >= 0; i--) {
+            depth[i] = depth[parent[i]] + 1;
+            if (i < n && depth[i] > deepest) {
+                deepest = depth[i];
+            }
+        }
+
+        if (deepest <= max_bits) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            scaled[i] = (scaled[i] + 1) / 2;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        lengths[order[i]] = (uint8_t)depth[i];
+    }
+}
+
+// Run length encode code lengths with the code length alphabet of RFC 1951 3.2.7
+// Returns the number of code length symbols, each stored as symbol | extra bits value << 5
+static int encode_code_lengths(const uint8_t *lengths, int count, uint16_t *encoded) {
+    int i = 0, n = 0, run, r;
+
+    while (i < count) {
+        for (run = 1; i + run < count && lengths[i + run] == lengths[i]; run++);
+
+        if (lengths[i] == 0) {
+            while (run >= 11) {
+                r = run < 138 ? run : 138;
+                encoded[n++] = 18 | (uint16_t)(r - 11) << 5;
+                run -= r;
+                i += r;
+            }
+            if (run >= 3) {
+                encoded[n++] = 17 | (uint16_t)(run - 3) << 5;
+                i += run;
+                run = 0;
+            }
+        } else {
+            encoded[n++] = lengths[i];
+            i++;
+            run--;
+            while (run >= 3) {
+                r = run < 6 ? run : 6;
+                encoded[n++] = 16 | (uint16_t)(r - 3) << 5;
+                run -= r;
+                i += r;
+            }
+        }
+
+        for (; run > 0; run--) {
+            encoded[n++] = lengths[i++];
+        }
+    }
+
+    return n;
+}
+
+// Everything needed to write a dynamic Huffman block header and its symbols
+typedef struct DynamicCodes {
+    uint8_t literal_lengths[286];
+    uint16_t literal_codes[286];
+    uint8_t distance_lengths[30];
+    uint16_t distance_codes[30];
+    uint8_t code_length_lengths[19];
+    uint16_t code_length_codes[19];
+    uint16_t encoded[286 + 30];  // run length encoded literal and distance code lengths
+    int encoded_count;
+    int literal_count;           // HLIT + 257
+    int distance_count;          // HDIST + 1
+    int code_length_count;       // HCLEN + 4
+} DynamicCodes;
+
+// Order the code length code lengths are sent in
+static const uint8_t code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Build the dynamic codes for the given symbol frequencies and return the size of the block header in bits
+static size_t build_dynamic_codes(uint32_t *literal_freq, uint32_t *distance_freq, DynamicCodes *codes) {
+    uint8_t all_lengths[286 + 30];
+    uint32_t code_length_freq[19] = {0};
+    size_t bits;
+    int i, used;
+
+    // Inflaters reject a code with a single symbol, so give each tree at least two (as zlib does)
+    for (i = 0, used = 0; i < 286; i++) {
+        used += literal_freq[i] > 0;
+    }
+    for (i = 0; used < 2; i++) {
+        used += literal_freq[i] == 0;
+        literal_freq[i] += literal_freq[i] == 0;
+    }
+    for (i = 0, used = 0; i < 30; i++) {
+        used += distance_freq[i] > 0;
+    }
+    for (i = 0; used < 2; i++) {
+        used += distance_freq[i] == 0;
+        distance_freq[i] += distance_freq[i] == 0;
+    }
+
+    huffman_lengths(literal_freq, 286, 15, codes->literal_lengths);
+    huffman_lengths(distance_freq, 30, 15, codes->distance_lengths);
+    canonical_codes(codes->literal_lengths, 286, codes->literal_codes);
+    canonical_codes(codes->distance_lengths, 30, codes->distance_codes);
+
+    for (codes->literal_count = 286; codes->literal_lengths[codes->literal_count - 1] == 0; codes->literal_count--);
+    for (codes->distance_count = 30; codes->distance_lengths[codes->distance_count - 1] == 0; codes->distance_count--);
+
+    // Literal and distance code lengths are run length encoded as one sequence
+    memcpy(all_lengths, codes->literal_lengths, (size_t)codes->literal_count);
+    memcpy(all_lengths + codes->literal_count, codes->distance_lengths, (size_t)codes->distance_count);
+    codes->encoded_count = encode_code_lengths(all_lengths, codes->literal_count + codes->distance_count, codes->encoded);
+
+    for (i = 0; i < codes->encoded_count; i++) {
+        code_length_freq[codes->encoded[i] & 31]++;
+    }
+    huffman_lengths(code_length_freq, 19, 7, codes->code_length_lengths);
+    canonical_codes(codes->code_length_lengths, 19, codes->code_length_codes);
+    for (codes->code_length_count = 19; codes->code_length_lengths[code_length_order[codes->code_length_count - 1]] == 0
+         && codes->code_length_count > 4; codes->code_length_count--);
+
+    bits = 3 + 5 + 5 + 4 + 3 * (size_t)codes->code_length_count;
+    for (i = 0; i < codes->encoded_count; i++) {
+        int symbol = codes->encoded[i] & 31;
+        bits += codes->code_length_lengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+    }
+    return bits;
+}
+
+// Write the header of a dynamic Huffman block
+static void write_dynamic_header(BitWriter *writer, const DynamicCodes *codes, int final) {
+    int i;
+
+    put_bits(writer, final, 1);
+    put_bits(writer, 2, 2);
+    put_bits(writer, (uint32_t)(codes->literal_count - 257), 5);
+    put_bits(writer, (uint32_t)(codes->distance_count - 1), 5);
+    put_bits(writer, (uint32_t)(codes->code_length_count - 4), 4);
+    for (i = 0; i < codes->code_length_count; i++) {
+        put_bits(writer, codes->code_length_lengths[code_length_order[i]], 3);
+    }
+
+    for (i = 0; i < codes->encoded_count; i++) {
+        int symbol = codes->encoded[i] & 31, extra = codes->encoded[i] >> 5;
+        put_bits(writer, codes->code_length_codes[symbol], codes->code_length_lengths[symbol]);
+        if (symbol >= 16) {
+            put_bits(writer, (uint32_t)extra, symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+        }
+    }
+}
+
+// Write data as stored blocks of at most 65535 bytes, only the last of which is marked final if final is set
+static void write_stored(BitWriter *writer, const uint8_t *data, size_t length, int final) {
+    size_t piece;
+    uint8_t header[4];
+
+    do {
+        piece = length < 65535 ? length : 65535;
+
+        put_bits(writer, final && piece == length, 1);
+        put_bits(writer, 0, 2);
+        flush_bits(writer);
+
+        header[0] = (uint8_t)piece;
+        header[1] = (uint8_t)(piece >> 8);
+        header[2] = (uint8_t)~piece;
+        header[3] = (uint8_t)(~piece >> 8);
+        if (writer_reserve(writer, piece + 4) != 0) {
+            return;
+        }
+        byte_buffer_append(writer->out, header, 4);
+        byte_buffer_append(writer->out, data, piece);
+
+        data += piece;
+        length -= piece;
+    } while (length > 0);
+}
+
+// Write the symbols covering data[start, end) as one block of whichever allowed type is estimated smallest
+static void write_block(BitWriter *writer, const uint32_t *symbols, size_t count, const uint8_t *data,
+                        size_t start, size_t end, int final, int block_types) {
+    uint32_t literal_freq[286] = {0}, distance_freq[30] = {0};
+    size_t static_bits = 3, dynamic_bits, stored_bits, best_bits, extra_bits = 0, i;
+    DynamicCodes codes;
+    int type = PNG_BLOCK_STORED;
+
+    for (i = 0; i < count; i++) {
+        uint32_t length = symbols[i] & 0x1FF, distance = symbols[i] >> 9;
+        if (distance == 0) {
+            literal_freq[length]++;
+        } else {
+            int l = length_symbol[length], d = distance_symbol[distance];
+            literal_freq[257 + l]++;
+            distance_freq[d]++;
+            extra_bits += length_extra[l] + distance_extra[d];
+        }
+    }
+    literal_freq[256] = 1;
+
+    for (i = 0; i < 286; i++) {
+        static_bits += (size_t)literal_freq[i] * static_literal_lengths[i];
+    }
+    for (i = 0; i < 30; i++) {
+        static_bits += (size_t)distance_freq[i] * 5;
+    }
+    static_bits += extra_bits;
+
+    // Each stored piece costs a 3 bit header, up to 7 bits of padding and LEN/NLEN
+    stored_bits = ((end - start) / 65535 + 1) * 42 + (end - start) * 8;
+
+    best_bits = (size_t)-1;
+    if (block_types & PNG_BLOCK_STATIC) {
+        best_bits = static_bits;
+        type = PNG_BLOCK_STATIC;
+    }
+    if (block_types & PNG_BLOCK_STORED && stored_bits < best_bits) {
+        best_bits = stored_bits;
+        type = PNG_BLOCK_STORED;
+    }
+    if (block_types & PNG_BLOCK_DYNAMIC) {
+        dynamic_bits = build_dynamic_codes(literal_freq, distance_freq, &codes) + extra_bits;
+        for (i = 0; i < 286; i++) {
+            dynamic_bits += (size_t)literal_freq[i] * codes.literal_lengths[i];
+        }
+        for (i = 0; i < 30; i++) {
+            dynamic_bits += (size_t)distance_freq[i] * codes.distance_lengths[i];
+        }
+        if (dynamic_bits < best_bits) {
+            type = PNG_BLOCK_DYNAMIC;
+        }
+    }
+
+    if (type == PNG_BLOCK_STORED) {
+        write_stored(writer, data + start, end - start, final);
+    } else if (type == PNG_BLOCK_STATIC) {
+        put_bits(writer, final, 1);
+        put_bits(writer, 1, 2);
+        write_symbols(writer, symbols, count, static_literal_codes, static_literal_lengths,
+                      static_distance_codes, static_distance_lengths);
+    } else {
+        write_dynamic_header(writer, &codes, final);
+        write_symbols(writer, symbols, count, codes.literal_codes, codes.literal_lengths,
+                      codes.distance_codes, codes.distance_lengths);
+    }
+}
+
+// Compress data into out as a raw DEFLATE stream, calling flush (if not NULL) after every block but the last
+// flush may take the bytes of out and empty it, the writer only keeps the last few bits of the stream itself
+// Returns 0 on success and -1 if out could not grow
+static int deflate_blocks(ByteBuffer *out, const uint8_t *data, size_t length, double level, int block_types,
+                          BlockFlush flush, void *ctx) {
+    uint32_t *symbols;
+    LZ77Matcher *matcher;
+    BitWriter writer = {out, 0, 0, 0};
+    size_t pos = 0, start, count, piece;
+
+    pthread_once(&tables_once, init_tables);
+
+    // Nothing to gain from parsing the input if it is only going to be stored
+    if (block_types == PNG_BLOCK_STORED) {
+        do {
+            piece = length - pos < PNG_STORED_FLUSH_SIZE ? length - pos : PNG_STORED_FLUSH_SIZE;
+            write_stored(&writer, data + pos, piece, pos + piece == length);
+            pos += piece;
+            if (pos < length && flush != NULL && !writer.failed) {
+                flush(out, ctx);
+            }
+        } while (pos < length && !writer.failed);
+        return writer.failed ? -1 : 0;
+    }
+
+    symbols = (uint32_t*)malloc(PNG_BLOCK_SYMBOLS * sizeof(uint32_t));
+    if (symbols == NULL) {
+        printf("ERROR in png encoding. Could not allocate %zu bytes\n", PNG_BLOCK_SYMBOLS * sizeof(uint32_t));
+        return -1;
+    }
+    matcher = CreateLZ77Matcher(level);
+
+    do {
+        start = pos;
+        count = lz77_parse(matcher, data, length, &pos, symbols, PNG_BLOCK_SYMBOLS);
+        write_block(&writer, symbols, count, data, start, pos, pos == length, block_types);
+        if (pos < length && flush != NULL && !writer.failed) {
+            flush(out, ctx);
+        }
+    } while (pos < length && !writer.failed);
+
+    flush_bits(&writer);
+    FreeLZ77Matcher(matcher);
+    free(symbols);
+    return writer.failed ? -1 : 0;
+}
+
+// Compress data into out as a raw DEFLATE stream
+// level is on pbPlots' 0 to 10 scale and sets how hard the match finder looks for long matches
+// block_types is a mask of PNG_BLOCK_* types; each block is written as whichever allowed type is smallest
+// Returns 0 on success and -1 if out could not grow
+int png_deflate(ByteBuffer *out, const uint8_t *data, size_t length, double level, int block_types) {
+    return deflate_blocks(out, data, length, level, block_types, NULL, NULL);
+}
+
+// Compress data into out as a zlib stream: header, DEFLATE data and Adler-32 of the input
+// Level 0 only stores the data, any higher level picks stored, static or dynamic Huffman per block
+// Returns 0 on success and -1 if out could not grow
+static int zlib_compress_blocks(ByteBuffer *out, const uint8_t *data, size_t length, double level,
+                                BlockFlush flush, void *ctx) {
+    uint8_t header[2] = {0x78, 0x01}; // 32 KB window, no dictionary, header check bits
+    uint32_t adler = png_adler32(1, data, length);
+    uint8_t trailer[4] = {(uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler};
+
+    if (byte_buffer_append(out, header, 2) != 0 ||
+        deflate_blocks(out, data, length, level, level <= 0.0 ? PNG_BLOCK_STORED : PNG_BLOCK_ANY, flush, ctx) != 0 ||
+        byte_buffer_append(out, trailer, 4) != 0) {
+        return -1;
+    }
+    if (flush != NULL) {
+        flush(out, ctx);
+    }
+    return 0;
+}
+
+// Compress data into out as a zlib stream: header, DEFLATE data and Adler-32 of the input
+// Level 0 only stores the data, any higher level picks stored, static or dynamic Huffman per block
+// Returns 0 on success and -1 if out could not grow
+int png_zlib_compress(ByteBuffer *out, const uint8_t *data, size_t length, double level) {
+    return zlib_compress_blocks(out, data, length, level, NULL, NULL);
+}
+
+// Apply the PNG filter type to the row cur (prev is the unfiltered row above it) and return the
+// sum of the filtered bytes taken as signed values, the usual estimate of how well a row compresses
+static uint32_t filter_row(int type, const uint8_t *cur, const uint8_t *prev, size_t n, size_t bpp, uint8_t *out) {
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        int a = i >= bpp ? cur[i - bpp] : 0, b = prev[i], c = i >= bpp ? prev[i - bpp] : 0, predictor;
+
+        if (type == PNG_FILTER_SUB) {
+            predictor = a;
+        } else if (type == PNG_FILTER_UP) {
+            predictor = b;
+        } else if (type == PNG_FILTER_AVERAGE) {
+            predictor = (a + b) / 2;
+        } else if (type == PNG_FILTER_PAETH) {
+            int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        } else {
+            predictor = 0;
+        }
+
+        out[i] = (uint8_t)(cur[i] - predictor);
+        sum += out[i] < 128 ? out[i] : 256 - out[i];
+    }
+
+    return sum;
+}
+
+// The scanlines of the image, each a filter type byte followed by its filtered pixels
+// With adaptive set every row uses the filter that minimises its sum of absolute values, otherwise no filter
+uint8_t *png_scanlines(struct RGBABitmapImage *image, int color_type, int adaptive, size_t *length) {
+    size_t width = image->xLength, height = image->yLength;
+    size_t channels = color_type == PNG_COLOR_RGBA ? 4 : 1, n = width * channels, stride = 1 + n, x, y;
+    uint8_t *rows = (uint8_t*)malloc(stride * height + 1);
+    uint8_t *cur = (uint8_t*)malloc(n + 1), *prev = (uint8_t*)calloc(n + 1, 1), *trial = (uint8_t*)malloc(n + 1), *swap;
+    uint32_t sum, best_sum;
+    int type;
+
+    if (rows == NULL || cur == NULL || prev == NULL || trial == NULL) {
+        printf("ERROR in png encoding. Could not allocate the scanlines of a %zux%zu image\n", width, height);
+        free(rows);
+        free(cur);
+        free(prev);
+        free(trial);
+        *length = 0;
+        return NULL;
+    }
+
+    for (y = 0; y < height; y++) {
+        uint8_t *row = rows + y * stride;
+        const uint8_t *pixels = image->pixels + 4 * width * y;
+
+        // The framebuffer rows already are RGBA scanlines, greyscale keeps the red channel
+        if (channels == 4) {
+            memcpy(cur, pixels, n);
+        } else {
+            for (x = 0; x < width; x++) {
+                cur[x] = pixels[4 * x];
+            }
+        }
+
+        row[0] = PNG_FILTER_NONE;
+        best_sum = filter_row(PNG_FILTER_NONE, cur, prev, n, channels, row + 1);
+        for (type = PNG_FILTER_SUB; adaptive && type <= PNG_FILTER_PAETH; type++) {
+            sum = filter_row(type, cur, prev, n, channels, trial);
+            if (sum < best_sum) {
+                best_sum = sum;
+                row[0] = (uint8_t)type;
+                memcpy(row + 1, trial, n);
+            }
+        }
+
+        swap = prev;
+        prev = cur;
+        cur = swap;
+    }
+
+    free(cur);
+    free(prev);
+    free(trial);
+
+    *length = stride * height;
+    return rows;
+}
+
+// Store a 32 bit value big endian, the byte order of every PNG field
+static void store_be32(uint8_t *out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+}
+
+// Write one chunk: length, type, data and the CRC of type and data
+static int write_chunk(PngWriteCallback callback, void *ctx, const char *type, const uint8_t *data, size_t length) {
+    uint8_t header[8], trailer[4];
+    uint32_t crc;
+
+    store_be32(header, (uint32_t)length);
+    memcpy(header + 4, type, 4);
+    crc = png_crc32(0, header + 4, 4);
+    crc = png_crc32(crc, data, length);
+    store_be32(trailer, crc);
+
+    if (callback(header, 8, ctx) != 0 || (length > 0 && callback(data, length, ctx) != 0)) {
+        return -1;
+    }
+    return callback(trailer, 4, ctx);
+}
+
+// Where png_encode_to() sends the zlib stream, one IDAT chunk per flush
+struct IdatWriter {
+    PngWriteCallback callback;
+    void *ctx;
+    int result;
+};
+
+// Write the finished bytes of the zlib stream as one IDAT chunk and empty the buffer for the next block
+static void flush_idat(ByteBuffer *out, void *ctx) {
+    struct IdatWriter *writer = (struct IdatWriter*)ctx;
+
+    if (out->length > 0 && writer->result == 0) {
+        writer->result = write_chunk(writer->callback, writer->ctx, "IDAT", out->data, out->length);
+    }
+    out->length = 0;
+}
+
+// Encode the image as a PNG and hand it to callback piece by piece
+// The compressed data is written as an IDAT chunk after every DEFLATE block, so only one block of it is held in
+// memory at a time; the filtered scanlines the blocks are compressed from are built in full beforehand
+// Returns 0 on success and -1 if callback failed or the compressed data could not be allocated
+int png_encode_to(struct RGBABitmapImage *image, const PngOptions *options, PngWriteCallback callback, void *ctx) {
+    size_t width = image->xLength, height = image->yLength, raw_length;
+    ByteBuffer idat = {NULL, 0, 0};
+    struct IdatWriter writer;
+    uint8_t ihdr[13], phys[9], *raw;
+    int result;
+
+    store_be32(ihdr, (uint32_t)width);
+    store_be32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = 8;                    // bit depth
+    ihdr[9] = (uint8_t)options->color_type;
+    ihdr[10] = 0;                   // compression method: zlib
+    ihdr[11] = 0;                   // filter method: adaptive
+    ihdr[12] = 0;                   // no interlace
+
+    store_be32(phys, (uint32_t)options->pixels_per_meter);
+    store_be32(phys + 4, (uint32_t)options->pixels_per_meter);
+    phys[8] = 1;                    // unit: metre
+
+    result = callback(png_signature, 8, ctx);
+    if (result == 0) {
+        result = write_chunk(callback, ctx, "IHDR", ihdr, 13);
+    }
+    if (result == 0 && options->set_phys) {
+        result = write_chunk(callback, ctx, "pHYs", phys, 9);
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    // Stored output gains nothing from filtering, so only filter when compressing
+    raw = png_scanlines(image, options->color_type, options->level > 0.0, &raw_length);
+    if (raw == NULL) {
+        return -1;
+    }
+    writer.callback = callback;
+    writer.ctx = ctx;
+    writer.result = 0;
+    result = zlib_compress_blocks(&idat, raw, raw_length, options->level, flush_idat, &writer);
+    free(raw);
+    free(idat.data);
+
+    if (result == 0) {
+        result = writer.result;
+    }
+    if (result == 0) {
+        result = write_chunk(callback, ctx, "IEND", NULL, 0);
+    }
+    return result;
+}
+
+static int write_to_buffer(const uint8_t *data, size_t length, void *ctx) {
+    return byte_buffer_append((ByteBuffer*)ctx, data, length);
+}
+
+static int write_to_file(const uint8_t *data, size_t length, void *ctx) {
+    return fwrite(data, 1, length, (FILE*)ctx) == length ? 0 : -1;
+}
+
+static int write_to_fd(const uint8_t *data, size_t length, void *ctx) {
+    int fd = *(int*)ctx;
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// Options for an image of the given colour type and compression level without a pHYs chunk
+static PngOptions basic_options(int color_type, double level) {
+    PngOptions options;
+    options.color_type = color_type;
+    options.level = level;
+    options.set_phys = 0;
+    options.pixels_per_meter = 0.0;
+    return options;
+}
+
+// Encode the image as a PNG in memory, returning a malloc'd buffer of *length bytes
+// Returns NULL with *length 0 if the memory could not be allocated
+uint8_t *png_encode_with_options(struct RGBABitmapImage *image, const PngOptions *options, size_t *length) {
+    ByteBuffer png = {NULL, 0, 0};
+
+    if (png_encode_to(image, options, write_to_buffer, &png) != 0) {
+        free(png.data);
+        png.data = NULL;
+        png.length = 0;
+    }
+
+    *length = png.length;
+    return png.data;
+}
+
+// Encode the image as a PNG in memory, returning a malloc'd buffer of *length bytes
+uint8_t *png_encode(struct RGBABitmapImage *image, int color_type, double level, size_t *length) {
+    PngOptions options = basic_options(color_type, level);
+    return png_encode_with_options(image, &options, length);
+}
+
+// Encode the image as a PNG straight into an open file, returns 0 on success and -1 on a write error
+int png_write(struct RGBABitmapImage *image, int color_type, double level, FILE *file) {
+    PngOptions options = basic_options(color_type, level);
+    return png_encode_to(image, &options, write_to_file, file);
+}
+
+// Encode the image as a PNG straight into a file descriptor, returns 0 on success and -1 on a write error
+int png_write_fd(struct RGBABitmapImage *image, int color_type, double level, int fd) {
+    PngOptions options = basic_options(color_type, level);
+    return png_encode_to(image, &options, write_to_fd, &fd);
+}
+
+// Save the image as an RGBA PNG file at the default compression level
+// Returns 0 on success and -1 if the file could not be written
+int png_save(struct RGBABitmapImage *image, char *filename) {
+    FILE *file = fopen(filename, "wb");
+    int result;
+
+    if (file == NULL) {
+        printf("Not able to open the file: `%s`\n", filename);
+        return -1;
+    }
+
+    result = png_write(image, PNG_COLOR_RGBA, PNG_DEFAULT_LEVEL, file);
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        printf("ERROR in png_save: could not write `%s`\n", filename);
+    }
+    return result;
+}
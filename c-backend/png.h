@@ -0,0 +1,83 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// pbPlots.h has no include guard, so only the image struct it defines is declared here
+struct RGBABitmapImage;
+
+// Colour types of the PNG header that the encoder can write
+#define PNG_COLOR_GREYSCALE 0
+#define PNG_COLOR_RGBA 6
+
+// Compression levels are on the 0 to 10 scale of ConvertToPNGWithOptions(): level 0 writes the
+// scanlines unfiltered in stored blocks, any higher level filters every row adaptively and writes
+// each block as stored, static or dynamic Huffman, whichever is smallest. The level sets how long
+// the LZ77 hash chains are searched.
+#define PNG_DEFAULT_LEVEL 0.001
+
+// DEFLATE block types, as a mask of the types png_deflate() may choose from
+#define PNG_BLOCK_STORED 1
+#define PNG_BLOCK_STATIC 2
+#define PNG_BLOCK_DYNAMIC 4
+#define PNG_BLOCK_ANY (PNG_BLOCK_STORED | PNG_BLOCK_STATIC | PNG_BLOCK_DYNAMIC)
+
+// PNG scanline filter types
+#define PNG_FILTER_NONE 0
+#define PNG_FILTER_SUB 1
+#define PNG_FILTER_UP 2
+#define PNG_FILTER_AVERAGE 3
+#define PNG_FILTER_PAETH 4
+
+// Number of LZ77 symbols collected before they are written out as one DEFLATE block
+#define PNG_BLOCK_SYMBOLS 65536
+// Bytes of input stored (compression level 0) between two flushes of the output as an IDAT chunk,
+// a whole number of the 65535 byte stored blocks so the blocks come out the same as without flushing
+#define PNG_STORED_FLUSH_SIZE (16 * 65535)
+
+// STRUCTS
+struct ByteBuffer;
+typedef struct ByteBuffer ByteBuffer;
+
+struct PngOptions;
+typedef struct PngOptions PngOptions;
+
+// Growable array of bytes the encoder writes its output into
+struct ByteBuffer {
+    uint8_t *data;
+    size_t length;   // bytes written so far
+    size_t capacity; // bytes allocated
+};
+
+// What to write into the PNG file besides the pixels
+struct PngOptions {
+    int color_type;          // PNG_COLOR_RGBA or PNG_COLOR_GREYSCALE
+    double level;            // compression level from 0 to 10
+    int set_phys;            // write a pHYs chunk with the physical pixel size
+    double pixels_per_meter; // pixel density of the pHYs chunk
+};
+
+// Called with every piece of the PNG file in order, returns 0 on success and -1 on a write error
+typedef int (*PngWriteCallback)(const uint8_t *data, size_t length, void *ctx);
+
+// FUNCTION DEFINITIONS
+int byte_buffer_reserve(ByteBuffer *buffer, size_t extra);
+int byte_buffer_append(ByteBuffer *buffer, const uint8_t *data, size_t length);
+
+uint32_t png_crc32(uint32_t crc, const uint8_t *data, size_t length);
+uint32_t png_adler32(uint32_t adler, const uint8_t *data, size_t length);
+
+int png_deflate(ByteBuffer *out, const uint8_t *data, size_t length, double level, int block_types);
+int png_zlib_compress(ByteBuffer *out, const uint8_t *data, size_t length, double level);
+uint8_t *png_scanlines(struct RGBABitmapImage *image, int color_type, int adaptive, size_t *length);
+
+int png_encode_to(struct RGBABitmapImage *image, const PngOptions *options, PngWriteCallback callback, void *ctx);
+uint8_t *png_encode_with_options(struct RGBABitmapImage *image, const PngOptions *options, size_t *length);
+uint8_t *png_encode(struct RGBABitmapImage *image, int color_type, double level, size_t *length);
+int png_write(struct RGBABitmapImage *image, int color_type, double level, FILE *file);
+int png_write_fd(struct RGBABitmapImage *image, int color_type, double level, int fd);
+int png_save(struct RGBABitmapImage *image, char *filename);
+
+#endif
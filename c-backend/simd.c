@@ -0,0 +1,737 @@
+// SIMD kernels (matrix multiply, BLAS-1 vector operations and checksums) with runtime dispatch on the instruction sets the CPU supports
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/* Every kernel has a scalar version and, on x86, AVX2 and AVX-512 versions compiled with function
+   level target attributes, so the rest of the build needs no -mavx flags. simd_level() asks CPUID
+   (through __builtin_cpu_supports) which of them can run, and the LINREG_SIMD environment variable
+   (scalar, avx2 or avx512) can lower the choice, e.g. to compare the kernels against each other.
+*/
+
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+static SimdLevel detected_level = SIMD_SCALAR;
+static int detected_clmul = 0; // PCLMULQDQ and SSE4.1 for the folded CRC32, whatever LINREG_SIMD says
+
+// Work out the best instruction set supported by this CPU, capped by LINREG_SIMD if it is set
+static void detect_level(void) {
+    SimdLevel level = SIMD_SCALAR;
+    char *requested = getenv("LINREG_SIMD");
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = SIMD_AVX2;
+    }
+    if (level == SIMD_AVX2 && __builtin_cpu_supports("avx512f")) {
+        level = SIMD_AVX512;
+    }
+    detected_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+
+    if (requested != NULL) {
+        if (strcmp(requested, "scalar") == 0) {
+            level = SIMD_SCALAR;
+        } else if (strcmp(requested, "avx2") == 0 && level > SIMD_AVX2) {
+            level = SIMD_AVX2;
+        }
+    }
+
+    detected_level = level;
+}
+
+// Returns the best instruction set supported by this CPU, capped by LINREG_SIMD if it is set
+// It is only worked out on the first call, so LINREG_SIMD has to be set before the process starts
+SimdLevel simd_level(void) {
+    pthread_once(&level_once, detect_level);
+    return detected_level;
+}
+
+// Name of an instruction set for printing
+const char *simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SIMD_AVX512: return "avx512";
+        case SIMD_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+// MATRIX MULTIPLY -------------------------------
+
+/* C = A * B for row-major A (nxk), B (kxm) and C (nxm), following the usual GotoBLAS layering:
+    - B is packed a KC x NC panel at a time into strips of NR columns, contiguous over k
+    - A is packed an MC x KC block at a time into strips of MR rows, contiguous over k
+    - the microkernel keeps an MR x NR tile of C in registers and walks both strips once
+   so the innermost loop only ever streams through packed, contiguous, cache-resident data.
+*/
+
+// Microkernel: C[0:MR][0:NR] += Ap * Bp over kc steps, with C having row stride ldc
+typedef void (*GemmKernel)(size_t kc, const double *Ap, const double *Bp, double *C, size_t ldc);
+
+static void gemm_kernel_scalar(size_t kc, const double *Ap, const double *Bp, double *C, size_t ldc) {
+    double acc[GEMM_MR][8] = {{0.0}};
+    size_t kk, i, j;
+
+    for (kk = 0; kk < kc; kk++) {
+        for (i = 0; i < GEMM_MR; i++) {
+            double a = Ap[kk * GEMM_MR + i];
+            for (j = 0; j < 8; j++) {
+                acc[i][j] += a * Bp[kk * 8 + j];
+            }
+        }
+    }
+
+    for (i = 0; i < GEMM_MR; i++) {
+        for (j = 0; j < 8; j++) {
+            C[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2(size_t kc, const double *Ap, const double *Bp, double *C, size_t ldc) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d b0, b1, a;
+    size_t kk;
+
+    for (kk = 0; kk < kc; kk++, Ap += GEMM_MR, Bp += 8) {
+        b0 = _mm256_load_pd(Bp);
+        b1 = _mm256_load_pd(Bp + 4);
+        a = _mm256_broadcast_sd(Ap);
+        c00 = _mm256_fmadd_pd(a, b0, c00); c01 = _mm256_fmadd_pd(a, b1, c01);
+        a = _mm256_broadcast_sd(Ap + 1);
+        c10 = _mm256_fmadd_pd(a, b0, c10); c11 = _mm256_fmadd_pd(a, b1, c11);
+        a = _mm256_broadcast_sd(Ap + 2);
+        c20 = _mm256_fmadd_pd(a, b0, c20); c21 = _mm256_fmadd_pd(a, b1, c21);
+        a = _mm256_broadcast_sd(Ap + 3);
+        c30 = _mm256_fmadd_pd(a, b0, c30); c31 = _mm256_fmadd_pd(a, b1, c31);
+    }
+
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c00));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c01));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c10));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c11));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c20));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c21));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c30));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c31));
+}
+
+__attribute__((target("avx512f")))
+static void gemm_kernel_avx512(size_t kc, const double *Ap, const double *Bp, double *C, size_t ldc) {
+    __m512d c00 = _mm512_setzero_pd(), c01 = _mm512_setzero_pd();
+    __m512d c10 = _mm512_setzero_pd(), c11 = _mm512_setzero_pd();
+    __m512d c20 = _mm512_setzero_pd(), c21 = _mm512_setzero_pd();
+    __m512d c30 = _mm512_setzero_pd(), c31 = _mm512_setzero_pd();
+    __m512d b0, b1, a;
+    size_t kk;
+
+    for (kk = 0; kk < kc; kk++, Ap += GEMM_MR, Bp += 16) {
+        b0 = _mm512_load_pd(Bp);
+        b1 = _mm512_load_pd(Bp + 8);
+        a = _mm512_set1_pd(Ap[0]);
+        c00 = _mm512_fmadd_pd(a, b0, c00); c01 = _mm512_fmadd_pd(a, b1, c01);
+        a = _mm512_set1_pd(Ap[1]);
+        c10 = _mm512_fmadd_pd(a, b0, c10); c11 = _mm512_fmadd_pd(a, b1, c11);
+        a = _mm512_set1_pd(Ap[2]);
+        c20 = _mm512_fmadd_pd(a, b0, c20); c21 = _mm512_fmadd_pd(a, b1, c21);
+        a = _mm512_set1_pd(Ap[3]);
+        c30 = _mm512_fmadd_pd(a, b0, c30); c31 = _mm512_fmadd_pd(a, b1, c31);
+    }
+
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c00));
+    _mm512_storeu_pd(C + 8, _mm512_add_pd(_mm512_loadu_pd(C + 8), c01));
+    C += ldc;
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c10));
+    _mm512_storeu_pd(C + 8, _mm512_add_pd(_mm512_loadu_pd(C + 8), c11));
+    C += ldc;
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c20));
+    _mm512_storeu_pd(C + 8, _mm512_add_pd(_mm512_loadu_pd(C + 8), c21));
+    C += ldc;
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c30));
+    _mm512_storeu_pd(C + 8, _mm512_add_pd(_mm512_loadu_pd(C + 8), c31));
+}
+#endif
+
+// Pack the kc x nc block of B at B (row stride ldb) into strips of nr columns, zero padding the last strip
+static void pack_B(size_t kc, size_t nc, size_t nr, const double *B, size_t ldb, double *Bp) {
+    size_t j0, kk, j, width;
+
+    for (j0 = 0; j0 < nc; j0 += nr) {
+        width = nc - j0 < nr ? nc - j0 : nr;
+        for (kk = 0; kk < kc; kk++) {
+            for (j = 0; j < width; j++) {
+                Bp[j] = B[(size_t)kk * ldb + j0 + j];
+            }
+            for (; j < nr; j++) {
+                Bp[j] = 0.0;
+            }
+            Bp += nr;
+        }
+    }
+}
+
+// Pack the mc x kc block of A at A (row stride lda) into strips of MR rows, zero padding the last strip
+static void pack_A(size_t mc, size_t kc, const double *A, size_t lda, double *Ap) {
+    size_t i0, kk, i, height;
+
+    for (i0 = 0; i0 < mc; i0 += GEMM_MR) {
+        height = mc - i0 < GEMM_MR ? mc - i0 : GEMM_MR;
+        for (kk = 0; kk < kc; kk++) {
+            for (i = 0; i < height; i++) {
+                Ap[i] = A[(size_t)(i0 + i) * lda + kk];
+            }
+            for (; i < GEMM_MR; i++) {
+                Ap[i] = 0.0;
+            }
+            Ap += GEMM_MR;
+        }
+    }
+}
+
+// Small products: plain i-k-j loops, which walk B and C along rows
+static void gemm_small(size_t n, size_t m, size_t k, const double *A, size_t lda, const double *B, size_t ldb, double *C, size_t ldc) {
+    size_t i, j, kk;
+
+    for (i = 0; i < n; i++) {
+        for (kk = 0; kk < k; kk++) {
+            double a = A[(size_t)i * lda + kk];
+            const double *B_row = B + (size_t)kk * ldb;
+            double *C_row = C + (size_t)i * ldc;
+            for (j = 0; j < m; j++) {
+                C_row[j] += a * B_row[j];
+            }
+        }
+    }
+}
+
+// C = A * B (row-major; A is nxk, B is kxm, C is nxm) using the microkernel for level
+// lda, ldb and ldc are the row strides, so any of the three can be a block of a larger matrix
+void gemm(SimdLevel level, size_t n, size_t m, size_t k, const double *A, size_t lda, const double *B, size_t ldb, double *C, size_t ldc) {
+    GemmKernel kernel = gemm_kernel_scalar;
+    size_t nr = 8, jc, pc, ic, jr, ir, nc, kc, mc, i, j;
+    double *Ap, *Bp, tile[GEMM_MR * 16];
+
+    if (ldc == m) {
+        memset(C, 0, (size_t)n * m * sizeof(double));
+    } else {
+        for (i = 0; i < n; i++) {
+            memset(C + (size_t)i * ldc, 0, (size_t)m * sizeof(double));
+        }
+    }
+    if ((long long)n * m * k <= GEMM_SMALL_SIZE) {
+        gemm_small(n, m, k, A, lda, B, ldb, C, ldc);
+        return;
+    }
+
+#ifdef SIMD_X86
+    if (level == SIMD_AVX512) {
+        kernel = gemm_kernel_avx512;
+        nr = 16;
+    } else if (level == SIMD_AVX2) {
+        kernel = gemm_kernel_avx2;
+    }
+#endif
+
+    // 64 byte alignment lets the kernels use aligned loads on the packed B strips
+    if (posix_memalign((void**)&Ap, 64, (size_t)GEMM_MC * GEMM_KC * sizeof(double)) != 0 ||
+        posix_memalign((void**)&Bp, 64, (size_t)GEMM_KC * (GEMM_NC + 16) * sizeof(double)) != 0) {
+        printf("ERROR in matrix-matrix multiplication. Could not allocate packing buffers\n");
+        return;
+    }
+
+    for (jc = 0; jc < m; jc += GEMM_NC) {
+        nc = m - jc < GEMM_NC ? m - jc : GEMM_NC;
+        for (pc = 0; pc < k; pc += GEMM_KC) {
+            kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            pack_B(kc, nc, nr, B + (size_t)pc * ldb + jc, ldb, Bp);
+
+            for (ic = 0; ic < n; ic += GEMM_MC) {
+                mc = n - ic < GEMM_MC ? n - ic : GEMM_MC;
+                pack_A(mc, kc, A + (size_t)ic * lda + pc, lda, Ap);
+
+                for (jr = 0; jr < nc; jr += nr) {
+                    for (ir = 0; ir < mc; ir += GEMM_MR) {
+                        const double *Ap_strip = Ap + (size_t)ir * kc;
+                        const double *Bp_strip = Bp + (size_t)jr * kc;
+                        double *C_tile = C + (size_t)(ic + ir) * ldc + jc + jr;
+
+                        if (mc - ir >= GEMM_MR && nc - jr >= nr) {
+                            kernel(kc, Ap_strip, Bp_strip, C_tile, ldc);
+                        } else {
+                            // Edge tile: compute the full register tile aside and add the part inside C
+                            memset(tile, 0, sizeof(tile));
+                            kernel(kc, Ap_strip, Bp_strip, tile, nr);
+                            for (i = 0; i < GEMM_MR && ir + i < mc; i++) {
+                                for (j = 0; j < nr && jr + j < nc; j++) {
+                                    C_tile[(size_t)i * ldc + j] += tile[i * nr + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    free(Ap);
+    free(Bp);
+}
+
+// VECTOR (BLAS-1) KERNELS -------------------------------
+
+/* dot, nrm2, axpy and scal over contiguous arrays. Each version keeps four independent accumulators
+   (4 scalars, or 4 AVX2/AVX-512 registers) so consecutive additions do not wait on each other.
+*/
+
+static double dot_scalar(size_t n, const double *x, const double *y) {
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        s0 += x[i] * y[i];
+        s1 += x[i + 1] * y[i + 1];
+        s2 += x[i + 2] * y[i + 2];
+        s3 += x[i + 3] * y[i + 3];
+    }
+    for (; i < n; i++) {
+        s0 += x[i] * y[i];
+    }
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+static void axpy_scalar(size_t n, double alpha, const double *x, double *y) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+static void scal_scalar(size_t n, double alpha, double *x) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        x[i] *= alpha;
+    }
+}
+
+static double max_abs_scalar(size_t n, const double *x) {
+    double m = 0.0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (fabs(x[i]) > m) {
+            m = fabs(x[i]);
+        }
+    }
+    return m;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2,fma")))
+static double dot_avx2(size_t n, const double *x, const double *y) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd(), s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+    double lanes[4], res;
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), s0);
+        s1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), s1);
+        s2 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 8), _mm256_loadu_pd(y + i + 8), s2);
+        s3 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 12), _mm256_loadu_pd(y + i + 12), s3);
+    }
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3)));
+    res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    return res + dot_scalar(n - i, x + i, y + i);
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(size_t n, double alpha, const double *x, double *y) {
+    __m256d a = _mm256_set1_pd(alpha);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        _mm256_storeu_pd(y + i + 4, _mm256_fmadd_pd(a, _mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    axpy_scalar(n - i, alpha, x + i, y + i);
+}
+
+__attribute__((target("avx2,fma")))
+static void scal_avx2(size_t n, double alpha, double *x) {
+    __m256d a = _mm256_set1_pd(alpha);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(a, _mm256_loadu_pd(x + i)));
+        _mm256_storeu_pd(x + i + 4, _mm256_mul_pd(a, _mm256_loadu_pd(x + i + 4)));
+    }
+    scal_scalar(n - i, alpha, x + i);
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(size_t n, const double *x, const double *y) {
+    __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd(), s2 = _mm512_setzero_pd(), s3 = _mm512_setzero_pd();
+    double res;
+    size_t i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), s0);
+        s1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 8), _mm512_loadu_pd(y + i + 8), s1);
+        s2 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 16), _mm512_loadu_pd(y + i + 16), s2);
+        s3 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 24), _mm512_loadu_pd(y + i + 24), s3);
+    }
+    res = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(s0, s1), _mm512_add_pd(s2, s3)));
+
+    return res + dot_scalar(n - i, x + i, y + i);
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(size_t n, double alpha, const double *x, double *y) {
+    __m512d a = _mm512_set1_pd(alpha);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        _mm512_storeu_pd(y + i, _mm512_fmadd_pd(a, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+        _mm512_storeu_pd(y + i + 8, _mm512_fmadd_pd(a, _mm512_loadu_pd(x + i + 8), _mm512_loadu_pd(y + i + 8)));
+    }
+    axpy_scalar(n - i, alpha, x + i, y + i);
+}
+
+__attribute__((target("avx512f")))
+static void scal_avx512(size_t n, double alpha, double *x) {
+    __m512d a = _mm512_set1_pd(alpha);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        _mm512_storeu_pd(x + i, _mm512_mul_pd(a, _mm512_loadu_pd(x + i)));
+        _mm512_storeu_pd(x + i + 8, _mm512_mul_pd(a, _mm512_loadu_pd(x + i + 8)));
+    }
+    scal_scalar(n - i, alpha, x + i);
+}
+#endif
+
+// x_T * y
+double blas_dot(SimdLevel level, size_t n, const double *x, const double *y) {
+#ifdef SIMD_X86
+    if (level == SIMD_AVX512) {
+        return dot_avx512(n, x, y);
+    }
+    if (level == SIMD_AVX2) {
+        return dot_avx2(n, x, y);
+    }
+#endif
+    return dot_scalar(n, x, y);
+}
+
+// |x|, without overflow or underflow in the sum of squares
+// The plain sum of squares is tried first; only if it overflows or underflows is x rescaled by its largest entry
+double blas_nrm2(SimdLevel level, size_t n, const double *x) {
+    double sum = blas_dot(level, n, x, x), scale, scaled, ratio;
+    size_t i;
+
+    if (sum < BLAS_NRM2_SAFE_MAX && sum > BLAS_NRM2_SAFE_MIN) {
+        return sqrt(sum);
+    }
+
+    scale = max_abs_scalar(n, x);
+    if (scale == 0.0 || isinf(scale) || isnan(sum)) {
+        return isnan(sum) ? sum : scale;
+    }
+
+    scaled = 0.0;
+    for (i = 0; i < n; i++) {
+        ratio = x[i] / scale;
+        scaled += ratio * ratio;
+    }
+    return scale * sqrt(scaled);
+}
+
+// y = y + alpha * x
+void blas_axpy(SimdLevel level, size_t n, double alpha, const double *x, double *y) {
+#ifdef SIMD_X86
+    if (level == SIMD_AVX512) {
+        axpy_avx512(n, alpha, x, y);
+        return;
+    }
+    if (level == SIMD_AVX2) {
+        axpy_avx2(n, alpha, x, y);
+        return;
+    }
+#endif
+    axpy_scalar(n, alpha, x, y);
+}
+
+// x = alpha * x
+void blas_scal(SimdLevel level, size_t n, double alpha, double *x) {
+#ifdef SIMD_X86
+    if (level == SIMD_AVX512) {
+        scal_avx512(n, alpha, x);
+        return;
+    }
+    if (level == SIMD_AVX2) {
+        scal_avx2(n, alpha, x);
+        return;
+    }
+#endif
+    scal_scalar(n, alpha, x);
+}
+
+// CHECKSUMS (CRC-32 AND ADLER-32 OF THE PNG ENCODER) -------------------------------
+
+/* CRC-32 without hardware help is computed slice-by-8: eight tables, built once, let eight
+   input bytes be folded into the CRC with eight independent lookups per step instead of a chain
+   of eight dependent ones. On x86 CPUs with PCLMULQDQ the buffer is instead folded 64 bytes at a
+   time with carry-less multiplies and Barrett reduced to 32 bits at the end (Gopal et al., "Fast
+   CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009). Adler-32
+   defers the modulo to every CHECKSUM_ADLER_NMAX bytes; the AVX2 version sums 32 bytes per step
+   with SAD for a and a weighted multiply-add for b.
+*/
+
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_tables[8][256];
+
+// crc_tables[0] is the usual byte table, crc_tables[k] advances a byte by k more zero bytes
+static void init_crc_tables(void) {
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t)i;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? CHECKSUM_CRC32_POLY ^ (c >> 1) : c >> 1;
+        }
+        crc_tables[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            crc_tables[k][i] = (crc_tables[k - 1][i] >> 8) ^ crc_tables[0][crc_tables[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+// Slice-by-8 update of the inverted CRC state
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *data, size_t length) {
+    uint32_t lo, hi;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc_tables[7][lo & 0xFF] ^ crc_tables[6][(lo >> 8) & 0xFF] ^
+              crc_tables[5][(lo >> 16) & 0xFF] ^ crc_tables[4][lo >> 24] ^
+              crc_tables[3][hi & 0xFF] ^ crc_tables[2][(hi >> 8) & 0xFF] ^
+              crc_tables[1][(hi >> 16) & 0xFF] ^ crc_tables[0][hi >> 24];
+    }
+    for (; length > 0; data++, length--) {
+        crc = crc_tables[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t adler32_scalar(uint32_t a, uint32_t b, const uint8_t *data, size_t length) {
+    size_t block, i;
+
+    while (length > 0) {
+        block = length < CHECKSUM_ADLER_NMAX ? length : CHECKSUM_ADLER_NMAX;
+        for (i = 0; i + 4 <= block; i += 4) {
+            a += data[i];
+            b += a;
+            a += data[i + 1];
+            b += a;
+            a += data[i + 2];
+            b += a;
+            a += data[i + 3];
+            b += a;
+        }
+        for (; i < block; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= CHECKSUM_ADLER_BASE;
+        b %= CHECKSUM_ADLER_BASE;
+        data += block;
+        length -= block;
+    }
+
+    return b << 16 | a;
+}
+
+#ifdef SIMD_X86
+// Fold constants for the bit reflected CRC-32 polynomial: x^(4*128+64) and x^(4*128) mod P for the
+// 64 byte fold, x^(128+64) and x^128 for the 16 byte fold, x^64 for 128 -> 64 bits, then P and mu
+static const uint64_t crc_k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+static const uint64_t crc_k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+static const uint64_t crc_k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+static const uint64_t crc_poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+
+// Fold a multiple of 16 bytes (at least 64) into the inverted CRC state with carry-less multiplies
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t length) {
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i*)crc_k1k2);
+    data += 64;
+    length -= 64;
+
+    // Four independent 128 bit lanes, each folded 64 bytes forward per step
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        data += 64;
+        length -= 64;
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i*)crc_k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining 16 byte blocks
+    while (length >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        length -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)crc_k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)crc_poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+// Horizontal sum of the eight 32 bit lanes
+__attribute__((target("avx2")))
+static uint32_t hsum_epi32_avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static uint32_t adler32_avx2(uint32_t a, uint32_t b, const uint8_t *data, size_t length) {
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                             16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+    size_t blocks = length / 32, n;
+
+    while (blocks > 0) {
+        // Within CHECKSUM_ADLER_NMAX bytes none of the 32 bit lane sums can overflow
+        __m256i va = zero, vb = zero, vprefix = zero;
+        n = blocks < CHECKSUM_ADLER_NMAX / 32 ? blocks : CHECKSUM_ADLER_NMAX / 32;
+        blocks -= n;
+        b += a * (uint32_t)(n * 32);
+
+        for (; n > 0; n--, data += 32) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+            // Every earlier byte is added to b once for each of these 32 bytes
+            vprefix = _mm256_add_epi32(vprefix, va);
+            va = _mm256_add_epi32(va, _mm256_sad_epu8(bytes, zero));
+            vb = _mm256_add_epi32(vb, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+        }
+
+        vb = _mm256_add_epi32(vb, _mm256_slli_epi32(vprefix, 5));
+        a = (a + hsum_epi32_avx2(va)) % CHECKSUM_ADLER_BASE;
+        b = (b + hsum_epi32_avx2(vb)) % CHECKSUM_ADLER_BASE;
+    }
+
+    return adler32_scalar(a, b, data, length % 32);
+}
+#endif
+
+// Update a CRC-32 (the checksum of PNG chunks and gzip) with length more bytes, starting from crc = 0
+uint32_t checksum_crc32(SimdLevel level, uint32_t crc, const uint8_t *data, size_t length) {
+    size_t folded;
+
+    pthread_once(&crc_tables_once, init_crc_tables);
+    crc = ~crc;
+
+#ifdef SIMD_X86
+    // Every CPU with AVX2 has PCLMULQDQ, but check anyway; LINREG_SIMD=scalar selects slice-by-8
+    pthread_once(&level_once, detect_level);
+    if (level >= SIMD_AVX2 && length >= CHECKSUM_CRC32_FOLD_MIN && detected_clmul) {
+        folded = length & ~(size_t)15;
+        crc = crc32_pclmul(crc, data, folded);
+        data += folded;
+        length -= folded;
+    }
+#else
+    (void)level;
+    (void)folded;
+#endif
+
+    return ~crc32_slice8(crc, data, length);
+}
+
+// Update an Adler-32 checksum (the checksum of zlib streams) with length more bytes, starting from adler = 1
+uint32_t checksum_adler32(SimdLevel level, uint32_t adler, const uint8_t *data, size_t length) {
+#ifdef SIMD_X86
+    if (level >= SIMD_AVX2) {
+        return adler32_avx2(adler & 0xFFFF, adler >> 16, data, length);
+    }
+#else
+    (void)level;
+#endif
+    return adler32_scalar(adler & 0xFFFF, adler >> 16, data, length);
+}
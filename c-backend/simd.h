@@ -0,0 +1,48 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Instruction sets the kernels can be dispatched to at runtime
+typedef enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_AVX2 = 1,
+    SIMD_AVX512 = 2
+} SimdLevel;
+
+// Cache blocking of the matrix multiply: an MC x KC block of A and a KC x NC panel of B are packed at a time
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 4096
+// Rows of A handled by one register tile of the microkernel (its column count depends on the instruction set)
+#define GEMM_MR 4
+// Below this many multiply-adds (n*m*k) packing costs more than it saves
+#define GEMM_SMALL_SIZE (32 * 32 * 32)
+
+// Outside (SAFE_MIN, SAFE_MAX) the plain sum of squares in blas_nrm2 may have underflowed or overflowed
+#define BLAS_NRM2_SAFE_MIN 1e-280
+#define BLAS_NRM2_SAFE_MAX 1e280
+
+// Reflected CRC-32 polynomial of PNG/zlib, and the shortest input worth folding with PCLMULQDQ
+#define CHECKSUM_CRC32_POLY 0xEDB88320u
+#define CHECKSUM_CRC32_FOLD_MIN 64
+// Adler-32 modulus, and the most bytes that can be summed before b can overflow 32 bits
+#define CHECKSUM_ADLER_BASE 65521u
+#define CHECKSUM_ADLER_NMAX 5552
+
+// FUNCTION DEFINITIONS
+SimdLevel simd_level(void);
+const char *simd_level_name(SimdLevel level);
+
+void gemm(SimdLevel level, size_t n, size_t m, size_t k, const double *A, size_t lda, const double *B, size_t ldb, double *C, size_t ldc);
+
+double blas_dot(SimdLevel level, size_t n, const double *x, const double *y);
+double blas_nrm2(SimdLevel level, size_t n, const double *x);
+void blas_axpy(SimdLevel level, size_t n, double alpha, const double *x, double *y);
+void blas_scal(SimdLevel level, size_t n, double alpha, double *x);
+
+uint32_t checksum_crc32(SimdLevel level, uint32_t crc, const uint8_t *data, size_t length);
+uint32_t checksum_adler32(SimdLevel level, uint32_t adler, const uint8_t *data, size_t length);
+
+#endif
@@ -3,11 +3,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h> 
+#include <math.h>
+#include <time.h>
 #include "simple.h"
+#include "ingest.h"
 #include "pbPlots.h"
 #include "supportLib.h"
+#include "png.h"
 
 #define PLOT_PAD_AMOUNT 2.0
+#define PLOT_WIDTH 1000
+#define PLOT_HEIGHT 800
+// Above this many points each one is binned into a pixel count instead of drawn as a circle
+#define PLOT_DENSITY_THRESHOLD 100000
+// Above this many points only a sample is drawn: the x axis is split into columns PLOT_SAMPLE_CELL pixels wide
+// (about the size of a circle marker) and at most PLOT_SAMPLE_PER_COLUMN points are kept in each
+#define PLOT_SAMPLE_THRESHOLD 10000
+#define PLOT_SAMPLE_CELL 4
+#define PLOT_SAMPLE_PER_COLUMN 8
+// Smallest ratio of R_11 to the norm of the x column in the QR fallback before the x values are treated as constant
+#define SIMPLE_RANK_TOLERANCE 1e-12
 
 /* VARIABLES with types
     n - int - number of data point pairs to run regression on
@@ -17,95 +32,119 @@
 */
 
 /* NORMAL EQUATIONS solution (solve for b)
-    b = (X_T*X)^(-1) * X_T * y
+    b = (X_T*X)^(-1) * (X_T * y)
 */
 
-// GLOBALS -------------------------------
-volatile int n;
+/* STREAMING solution - the normal equations only need the sufficient statistics
+    m = sum((x - mean_x)(y - mean_y)) / sum((x - mean_x)^2)
+    c = mean_y - m * mean_x
+   which are accumulated one point at a time in O(1) memory, so X is never built
+*/
 
 // FUNCTIONS -------------------------------
 
-// Count the number of lines in an input file
-int count_lines(char *filename) {
-    FILE *fptr; 
-    char c;
-    int count = 0; 
-
-    fptr = fopen(filename, "r");
+// Struct for the x and y input arrays grown while the data file is streamed in
+struct PointBuffer {
+    DataInputs *data_inputs;
+    size_t capacity_x, capacity_y;
+};
+
+// Append a row in format 'y,x' to the growing input arrays, returns -1 if they could not grow
+static int append_point(const double *row, int cols, void *ctx) {
+    struct PointBuffer *buffer = (struct PointBuffer*)ctx;
+    DataInputs *data_inputs = buffer->data_inputs;
+    size_t i = data_inputs->x_inputs.size;
+    double *x, *y;
+
+    if (cols < 2) {
+        return 0;
+    }
 
-    if (fptr == NULL) {
-        printf("Failed at counting lines for file: `%s`\n", filename);
+    // Input is in format 'y,x' as y is dependent and x explanatory
+    // A buffer that grew is kept even if the other one then cannot, so both stay owned by data_inputs
+    x = grow_buffer(data_inputs->x_inputs.data, &buffer->capacity_x, i + 1);
+    if (x == NULL) {
         return -1;
     }
-
-    for (c = getc(fptr); c != EOF; c = getc(fptr)) {
-        if (c == '\n') { 
-            count++; 
-        }
+    data_inputs->x_inputs.data = x;
+    y = grow_buffer(data_inputs->y_inputs.data, &buffer->capacity_y, i + 1);
+    if (y == NULL) {
+        return -1;
     }
+    data_inputs->y_inputs.data = y;
 
-    fclose(fptr);
-    return count+1;
+    data_inputs->x_inputs.data[i] = row[1];
+    data_inputs->y_inputs.data[i] = row[0];
+    data_inputs->x_inputs.size = data_inputs->y_inputs.size = i + 1;
+    data_inputs->x_inputs.stride = data_inputs->y_inputs.stride = 1;
+    return 0;
 }
 
-// Read the data input from the csv file
-DataInputs read_data(void) {
-    FILE *fptr;  
-    DataInputs data_inputs;
-    char c, line[100];
-    int onx = 1, i = 0; // flag: 1 - on x field of input, 0 - on y field of input
-    double x, y;
-
-    data_inputs.x_inputs.size = n;
-    data_inputs.y_inputs.size = n;
-    data_inputs.x_inputs.data = (double*)malloc(n*sizeof(double));
-    data_inputs.y_inputs.data = (double*)malloc(n*sizeof(double));
-
-    fptr = fopen("../data/data.txt", "r");
-
-    if (fptr != NULL) {
-        while (fgets(line, sizeof(line), fptr)) {
-            // Input is in format 'y,x' as y is dependent and x explanatory
-            if (sscanf(line, "%lf,%lf", &y, &x) == 2) {
-                data_inputs.x_inputs.data[i] = x;
-                data_inputs.y_inputs.data[i] = y;
-                i++;
-            } else {
-                fprintf(stderr, "Invalid line format: %s", line);
-            }
-        }
+// Read the points of a csv file, or of csv text in memory if filename is NULL, into the regression
+// Returns 0 on success and -1 if the input could not be read or does not have 2 columns
+static int load_points(SimpleRegression *regression, char *filename, const char *data, size_t length) {
+    struct PointBuffer buffer;
+    int status;
+
+    // Only the points are replaced, the workspace is kept for the next fit
+    free(regression->data_inputs.x_inputs.data);
+    free(regression->data_inputs.y_inputs.data);
+    regression->data_inputs.x_inputs.data = regression->data_inputs.y_inputs.data = NULL;
+    regression->data_inputs.x_inputs.size = regression->data_inputs.y_inputs.size = 0;
+    regression->data_inputs.x_inputs.stride = regression->data_inputs.y_inputs.stride = 1;
+    regression->fitted = 0;
+    buffer.data_inputs = &regression->data_inputs;
+    buffer.capacity_x = buffer.capacity_y = 0;
+
+    if (filename != NULL) {
+        status = ingest_rows(filename, append_point, &buffer, &regression->ingest_stats);
     } else {
-        printf("Not able to open the file: `../data/data.txt`\n");
+        status = ingest_buffer(data, length, append_point, &buffer, &regression->ingest_stats);
+    }
+    if (status == 0 && regression->ingest_stats.cols < 2) {
+        printf("ERROR in reading data. Simple regression needs 2 columns per row but found %d\n", regression->ingest_stats.cols);
+        status = -1;
     }
 
-    fclose(fptr);
+    return status;
+}
+
+// Read the data input from the csv file in a single pass
+DataInputs read_data(void) {
+    SimpleRegression regression;
 
-    return data_inputs;
+    init_simple_regression(&regression);
+    if (load_points(&regression, "../data/data.txt", NULL, 0) == 0) {
+        print_ingest_stats("../data/data.txt", &regression.ingest_stats);
+    }
+
+    return regression.data_inputs;
 }
 
 // Generate the nx2 X matrix 
-Matrix gen_X(Vector x_values)  {
-    Matrix X; int i;
+Matrix gen_X(Workspace *ws, Vector x_values)  {
+    Matrix X; size_t i;
 
     X.n = x_values.size;
-    X.m = 2;
-    X.data = (double*)malloc(X.n * X.m * sizeof(double));
+    X.m = X.ld = 2;
+    X.data = (double*)workspace_alloc(ws, X.n * X.m * sizeof(double));
 
     for (i = 0; i < x_values.size; i++) {
         X.data[2*i] = 1.0;
-        X.data[2*i + 1] = x_values.data[i];
+        X.data[2*i + 1] = x_values.data[i * x_values.stride];
     }
 
     return X;
 }
 
 // Returns (min, max) of data_values list
-Vector get_min_max(double *data_values, int length) {
+Vector get_min_max(double *data_values, size_t length) {
     Vector min_max;
     double min, max;
-    int i;
+    size_t i;
 
     min_max.size = 2;
+    min_max.stride = 1;
     min_max.data = (double*)malloc(sizeof(double) * 2);
     min = max = data_values[0];
     
@@ -125,25 +164,115 @@ Vector get_min_max(double *data_values, int length) {
     return min_max;
 }
 
-// Pad an array by +- a PLOT_PAD_AMOUNT of the max and min on either side
-double *get_padded_points(double *points, double min, double max, int length, double pad_amount) {
-    double *padded_points;
-    int i;
+// Index of the stratum of value in [min, max] split into count equal strata
+// Values outside the range, infinities and NaN are clamped to the first or last stratum
+static int stratum(double value, double min, double max, int count) {
+    double t = max > min ? (value - min) / (max - min) * count : 0.0;
+    if (!(t >= 0.0)) {
+        return 0;
+    }
+    return t >= count ? count - 1 : (int)t;
+}
+
+// Whether point a = (x_a, y_a) comes before point b when ordered by y, and then by x
+static int before_in_y(double x_a, double y_a, double x_b, double y_b) {
+    return y_a < y_b || (y_a == y_b && x_a < x_b);
+}
 
-    padded_points = (double*)malloc(sizeof(double) * (length + 2));
-    padded_points[0] = min - pad_amount;
+// Sample of the points stratified on x: [min_x, max_x] is split into columns, and each column keeps its lowest
+// and highest point plus, for per_column - 2 evenly spaced levels between them, the point nearest the level.
+// Returns at most columns * per_column points (per_column >= 2) ordered by column, so the size is bounded by the
+// plot width whatever the number of points. Ties are broken on x and y, so the sample does not depend on the
+// input order. Points with a non-finite coordinate are left out.
+DataInputs downsample_points(DataInputs data_inputs, double min_x, double max_x, int columns, int per_column) {
+    DataInputs sample;
+    double *low, *high, *distance, x, y, centre;
+    size_t *chosen, *lowest, *highest, *kept, i, slot, n = data_inputs.x_inputs.size, slots = (size_t)columns * per_column;
+    size_t none = (size_t)-1;
+    int column, level, levels = per_column - 2, k;
+
+    chosen = (size_t*)malloc(sizeof(size_t) * slots);
+    distance = (double*)malloc(sizeof(double) * slots);
+    low = (double*)malloc(sizeof(double) * columns);
+    high = (double*)malloc(sizeof(double) * columns);
+    for (i = 0; i < slots; i++) {
+        chosen[i] = none;
+    }
 
-    for (i = 0; i < length; i++) {
-        padded_points[i+1] = points[i];
+    // First pass: the lowest and highest point of each column, in its first and last slot
+    for (i = 0; i < n; i++) {
+        x = data_inputs.x_inputs.data[i];
+        y = data_inputs.y_inputs.data[i];
+        if (!isfinite(x) || !isfinite(y)) {
+            continue;
+        }
+        column = stratum(x, min_x, max_x, columns);
+        lowest = &chosen[(size_t)column * per_column];
+        highest = lowest + per_column - 1;
+
+        if (*lowest == none || before_in_y(x, y, data_inputs.x_inputs.data[*lowest], low[column])) {
+            *lowest = i;
+            low[column] = y;
+        }
+        if (*highest == none || before_in_y(data_inputs.x_inputs.data[*highest], high[column], x, y)) {
+            *highest = i;
+            high[column] = y;
+        }
+    }
+
+    // Second pass: the point nearest the centre of each level between the lowest and highest point
+    for (i = 0; i < n && levels > 0; i++) {
+        x = data_inputs.x_inputs.data[i];
+        y = data_inputs.y_inputs.data[i];
+        if (!isfinite(x) || !isfinite(y)) {
+            continue;
+        }
+        column = stratum(x, min_x, max_x, columns);
+        level = stratum(y, low[column], high[column], levels);
+        centre = low[column] + (level + 0.5) * (high[column] - low[column]) / levels;
+
+        slot = (size_t)column * per_column + 1 + level;
+        if (chosen[slot] == none || fabs(y - centre) < distance[slot] ||
+            (fabs(y - centre) == distance[slot] && before_in_y(x, y, data_inputs.x_inputs.data[chosen[slot]], data_inputs.y_inputs.data[chosen[slot]]))) {
+            chosen[slot] = i;
+            distance[slot] = fabs(y - centre);
+        }
     }
 
-    padded_points[i+1] = max + pad_amount;
+    // Gather the chosen points column by column, a point kept as both an extreme and a level is taken once
+    sample.x_inputs.data = (double*)malloc(sizeof(double) * (slots < n ? slots : n));
+    sample.y_inputs.data = (double*)malloc(sizeof(double) * (slots < n ? slots : n));
+    sample.x_inputs.size = sample.y_inputs.size = 0;
+    sample.x_inputs.stride = sample.y_inputs.stride = 1;
+    for (column = 0; column < columns; column++) {
+        kept = &chosen[(size_t)column * per_column];
+
+        for (k = 0; k < per_column; k++) {
+            if (kept[k] == none || (k > 0 && kept[k] == kept[0]) || (k < per_column - 1 && kept[k] == kept[per_column - 1])) {
+                continue;
+            }
+            sample.x_inputs.data[sample.x_inputs.size++] = data_inputs.x_inputs.data[kept[k]];
+            sample.y_inputs.data[sample.y_inputs.size++] = data_inputs.y_inputs.data[kept[k]];
+        }
+    }
 
-    return padded_points;
+    free(chosen);
+    free(distance);
+    free(low);
+    free(high);
+    return sample;
 }
 
 // Plot the data points and linear regression line generated
 void plot_results(DataInputs data_inputs, Vector c_m) {
+    if (plot_results_to(data_inputs, c_m, "../output/simple_regression.png") == 0) {
+        printf("Plot saved to `../output/simple_regression.png`\n");
+    }
+}
+
+// Plot the data points and the line (c, m) to a PNG file, returns 0 on success and -1 if it could not be written
+int plot_results_to(DataInputs data_inputs, Vector c_m, char *filename) {
+    int status;
     double c = c_m.data[0];
     double m = c_m.data[1];
 
@@ -162,23 +291,42 @@ void plot_results(DataInputs data_inputs, Vector c_m) {
     double xs [] = {min_x_regression, max_x_regression};
 	double ys [] = {min_x_regression * m + c, max_x_regression * m + c};
 
-    // Pad the data inputs to make sure they show up on the plot by adding artificial points
-    double *padded_x_points = get_padded_points(data_inputs.x_inputs.data, min_x_dataset, max_x_dataset, data_inputs.x_inputs.size, PLOT_PAD_AMOUNT);
-    double *padded_y_points = get_padded_points(data_inputs.y_inputs.data, min_y_dataset, max_y_dataset, data_inputs.y_inputs.size, PLOT_PAD_AMOUNT);
+    // Pad the plot to make sure the data points show up on it by adding two artificial points. They lie on
+    // the boundaries, where no point is drawn, so they are given as their own series instead of copying the data
+    double pad_xs [] = {min_x_dataset - PLOT_PAD_AMOUNT, max_x_dataset + PLOT_PAD_AMOUNT};
+    double pad_ys [] = {min_y_dataset - PLOT_PAD_AMOUNT, max_y_dataset + PLOT_PAD_AMOUNT};
+
+    // Very large inputs are binned into a density plot, large ones are thinned out to a sample
+    DataInputs points = data_inputs;
+    int sampled = 0;
+    if (data_inputs.x_inputs.size > PLOT_SAMPLE_THRESHOLD && data_inputs.x_inputs.size <= PLOT_DENSITY_THRESHOLD) {
+        points = downsample_points(data_inputs, min_x_dataset, max_x_dataset, PLOT_WIDTH / PLOT_SAMPLE_CELL, PLOT_SAMPLE_PER_COLUMN);
+        sampled = 1;
+    }
 
     ScatterPlotSeries *series = GetDefaultScatterPlotSeriesSettings();
     ScatterPlotSeries *regression_series= GetDefaultScatterPlotSeriesSettings();
+    ScatterPlotSeries *pad_series = GetDefaultScatterPlotSeriesSettings();
 
     // Plot the input data
-    series->xs = padded_x_points;
-	series->xsLength = data_inputs.x_inputs.size + 2;
-	series->ys = padded_y_points;
-	series->ysLength = data_inputs.y_inputs.size + 2;
+    series->xs = points.x_inputs.data;
+	series->xsLength = points.x_inputs.size;
+	series->ys = points.y_inputs.data;
+	series->ysLength = points.y_inputs.size;
 	series->linearInterpolation = false;
-    series->pointType = L"circles";
+    series->pointType = data_inputs.x_inputs.size > PLOT_DENSITY_THRESHOLD ? L"density" : L"circles";
 	series->pointTypeLength = wcslen(series->pointType);
 	series->color = GetBlack();
 
+    pad_series->xs = pad_xs;
+    pad_series->xsLength = 2;
+    pad_series->ys = pad_ys;
+    pad_series->ysLength = 2;
+    pad_series->linearInterpolation = false;
+    pad_series->pointType = L"pixels";
+    pad_series->pointTypeLength = wcslen(pad_series->pointType);
+    pad_series->color = GetBlack();
+
     // Plot the regression line
     regression_series->xs = xs;
 	regression_series->xsLength = 2;
@@ -192,8 +340,8 @@ void plot_results(DataInputs data_inputs, Vector c_m) {
 
     // Set axes data
 	ScatterPlotSettings *settings = GetDefaultScatterPlotSettings();
-	settings->width = 1000;
-	settings->height = 800;
+	settings->width = PLOT_WIDTH;
+	settings->height = PLOT_HEIGHT;
 	settings->autoBoundaries = true;
 	settings->autoPadding = true;
     settings->title = L"Linear Regression";
@@ -204,22 +352,22 @@ void plot_results(DataInputs data_inputs, Vector c_m) {
     settings->yLabelLength = wcslen(settings->yLabel);
 
     // Actually generate plot
-	ScatterPlotSeries *s [] = {series, regression_series};
+	ScatterPlotSeries *s [] = {series, regression_series, pad_series};
 	settings->scatterPlotSeries = s;
-	settings->scatterPlotSeriesLength = 2;
+	settings->scatterPlotSeriesLength = 3;
 
     RGBABitmapImageReference *canvasReference= CreateRGBABitmapImageReference();
     DrawScatterPlotFromSettings(canvasReference, settings);
 
-    // Convert to PNG file and save it 
-	size_t length;
-	double *pngdata = ConvertToPNG(&length, canvasReference->image);
-	WriteToFile(pngdata, length, "../output/simple_regression.png");
-    printf("Plot saved to `../output/simple_regression.png`\n");
+    // Encode the canvas as a PNG straight into the output file
+    status = png_save(canvasReference->image, filename);
 	DeleteImage(canvasReference->image);
 
-    free(padded_x_points);
-    free(padded_y_points);
+    if (sampled) {
+        free(points.x_inputs.data);
+        free(points.y_inputs.data);
+    }
+    return status;
 }
 
 // Save coefficients m and c to plane.txt
@@ -230,42 +378,310 @@ void save_line(double m, double c) {
     fclose(fptr);
 }
 
-void simple_regression(void) {
+// Wall clock time in seconds, for timing the fit and the plot separately
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Returns (c, m) for the line of best fit through the data points, without plotting anything, or a vector of
+// size 0 if the points do not determine a line (fewer than 2 distinct x values)
+// Everything is allocated from ws (or malloced if ws is NULL, and then the caller frees the result)
+Vector simple_regression_fit(Workspace *ws, DataInputs data_inputs) {
+    Matrix X, X_TX, R;
+    Vector X_Ty, Q_Ty, res;
+
+    res.size = 0;
+    res.stride = 1;
+    res.data = NULL;
+    if (data_inputs.x_inputs.size < 2) {
+        printf("ERROR in simple regression. Need at least 2 points with distinct x values but got %zu points\n", data_inputs.x_inputs.size);
+        return res;
+    }
+
+    // X_T*X and X_T*y are computed straight from X, without building X_T
+    X = gen_X(ws, data_inputs.x_inputs);
+    X_TX = multiply_transpose_matrix_self(ws, X);
+    X_Ty = multiply_transpose_matrix_vector(ws, X, data_inputs.y_inputs);
+
+    // X_T*X * (c, m) = X_T*y is solved by factorising X_T*X = L*D*L_T in place, without forming its inverse
+    if (ldlt_factorise_inplace(&X_TX)) {
+        res = solve_ldlt(ws, X_TX, X_Ty);
+    } else {
+        // Too ill-conditioned for the normal equations, so fall back to QR of X which does not square the condition number
+        R = QR_factorise_givens(ws, X, data_inputs.y_inputs, &Q_Ty);
+        if (fabs(R.data[R.ld + 1]) > SIMPLE_RANK_TOLERANCE * hypot(R.data[1], R.data[R.ld + 1])) {
+            res = solve_back_sub(ws, R, Q_Ty);
+        } else {
+            printf("ERROR in simple regression. Need at least 2 points with distinct x values but all have x = %lf\n", data_inputs.x_inputs.data[0]);
+        }
+        workspace_free(ws, R.data);
+        workspace_free(ws, Q_Ty.data);
+    }
+
+    workspace_free(ws, X.data);
+    workspace_free(ws, X_TX.data);
+    workspace_free(ws, X_Ty.data);
+    return res;
+}
+
+// Fit the line to ../data/data.txt and, if plot is set, render it to ../output/simple_regression.png
+// Returns 0 on success and -1 if the data could not be read or does not determine a line
+static int run_simple_regression(int plot) {
+    SimpleRegression regression;
+    DataInputs data_inputs;
+    Workspace ws;
+    double start;
+    int status = 0;
+
     printf("Running Simple Linear Regression on Input from `../data/data.txt`\n");
 
     // Loading in data 
-    n = count_lines("../data/data.txt");
-    DataInputs data_inputs = read_data();
-
+    init_simple_regression(&regression);
+    if (load_simple_regression_file(&regression, "../data/data.txt") != 0) {
+        free_simple_regression(&regression);
+        return -1;
+    }
+    print_ingest_stats("../data/data.txt", &regression.ingest_stats);
+    data_inputs = regression.data_inputs;
 
     // PERFORM SIMPLE LINEAR REGRESSION ===========
-    Matrix X = gen_X(data_inputs.x_inputs);
-    Matrix X_T = transpose_matrix(X);
-    Matrix X_TX = multiply_matrix_matrix(X_T, X);
-    Matrix inverse_X_TX = invert_matrix_2by2(X_TX);
-    Matrix final_matrix = multiply_matrix_matrix(inverse_X_TX, X_T);
-    // Final step is multiply final_matrix by y vector
-    Vector res = multiply_matrix_vector(final_matrix, data_inputs.y_inputs);
-
-    // OUTPUT RESULTS ===========
+    init_workspace(&ws);
+    start = now_seconds();
+    Vector res = simple_regression_fit(&ws, data_inputs);
+    printf("Fitted in %.3fs (peak workspace %.2f MB)\n", now_seconds() - start, ws.peak / 1e6);
+
+    if (res.size == 0) {
+        status = -1;
+    } else {
+        // OUTPUT RESULTS ===========
+        // Printing in y = mx + c format, rounding coefficients to 2dp
+        printf("Your regression line equation is:\n");
+        printf("y = %.2fx + %.2f\n", res.data[1], res.data[0]);
+        save_line(res.data[1], res.data[0]);
+
+        if (plot) {
+            start = now_seconds();
+            plot_results(data_inputs, res);
+            printf("Plotted in %.3fs\n", now_seconds() - start);
+        }
+    }
+
+    // Free used memory
+    free_simple_regression(&regression);
+    free_workspace(&ws);
+    return status;
+}
+
+// Start an empty regression with no points loaded
+void init_simple_regression(SimpleRegression *regression) {
+    regression->data_inputs.x_inputs.size = regression->data_inputs.y_inputs.size = 0;
+    regression->data_inputs.x_inputs.stride = regression->data_inputs.y_inputs.stride = 1;
+    regression->data_inputs.x_inputs.data = regression->data_inputs.y_inputs.data = NULL;
+    regression->ingest_stats.bytes = 0;
+    regression->ingest_stats.rows = regression->ingest_stats.cols = 0;
+    regression->ingest_stats.seconds = 0.0;
+    regression->c = regression->m = 0.0;
+    regression->fitted = 0;
+    init_workspace(&regression->workspace);
+}
+
+// Load the points of a csv file in format 'y,x' ('-' for stdin), replacing any loaded before
+// Returns 0 on success and -1 if the file could not be read
+int load_simple_regression_file(SimpleRegression *regression, char *filename) {
+    return load_points(regression, filename, NULL, 0);
+}
+
+// Load the points of csv text in format 'y,x' held in memory, replacing any loaded before
+int load_simple_regression_buffer(SimpleRegression *regression, const char *data, size_t length) {
+    return load_points(regression, NULL, data, length);
+}
+
+// Fit the line to the loaded points, returns 0 on success and -1 if there are not 2 distinct x values
+int fit_simple_regression(SimpleRegression *regression) {
+    DataInputs data_inputs = regression->data_inputs;
+    Vector min_max_x;
+    int distinct;
+
+    regression->fitted = 0;
+    if (data_inputs.x_inputs.size < 2) {
+        printf("ERROR in simple regression. Need at least 2 points with distinct x values but got %zu points\n", data_inputs.x_inputs.size);
+        return -1;
+    }
+    min_max_x = get_min_max(data_inputs.x_inputs.data, data_inputs.x_inputs.size);
+    distinct = min_max_x.data[0] != min_max_x.data[1];
+    free(min_max_x.data);
+    if (!distinct) {
+        printf("ERROR in simple regression. Need at least 2 points with distinct x values but all have x = %lf\n", data_inputs.x_inputs.data[0]);
+        return -1;
+    }
+
+    // Everything the previous fit allocated is released at once and its memory reused
+    workspace_reset(&regression->workspace);
+    Vector res = simple_regression_fit(&regression->workspace, data_inputs);
+    if (res.size == 0) {
+        return -1;
+    }
+    regression->c = res.data[0];
+    regression->m = res.data[1];
+    regression->fitted = 1;
+    return 0;
+}
+
+// Plot the loaded points and fitted line to a PNG file, returns 0 on success and -1 otherwise
+int plot_simple_regression(SimpleRegression *regression, char *filename) {
+    Vector c_m;
+    double coefficients[2];
+
+    if (!regression->fitted) {
+        printf("ERROR in plotting simple regression. The line has not been fitted yet\n");
+        return -1;
+    }
+    coefficients[0] = regression->c;
+    coefficients[1] = regression->m;
+    c_m.size = 2;
+    c_m.stride = 1;
+    c_m.data = coefficients;
+    return plot_results_to(regression->data_inputs, c_m, filename);
+}
+
+// Free the loaded points and the workspace, leaving an empty regression that can be loaded again
+void free_simple_regression(SimpleRegression *regression) {
+    free(regression->data_inputs.x_inputs.data);
+    free(regression->data_inputs.y_inputs.data);
+    free_workspace(&regression->workspace);
+    init_simple_regression(regression);
+}
+
+// Fit a line to a csv file in one call, setting c and m. Returns 0 on success and -1 on failure
+int simple_regression_from_file(char *filename, double *c, double *m) {
+    SimpleRegression regression;
+    int status;
+
+    init_simple_regression(&regression);
+    status = load_simple_regression_file(&regression, filename);
+    if (status == 0) {
+        status = fit_simple_regression(&regression);
+    }
+    *c = regression.c;
+    *m = regression.m;
+    free_simple_regression(&regression);
+    return status;
+}
+
+// Fit a line to csv text held in memory in one call, setting c and m. Returns 0 on success and -1 on failure
+int simple_regression_from_buffer(const char *data, size_t length, double *c, double *m) {
+    SimpleRegression regression;
+    int status;
+
+    init_simple_regression(&regression);
+    status = load_simple_regression_buffer(&regression, data, length);
+    if (status == 0) {
+        status = fit_simple_regression(&regression);
+    }
+    *c = regression.c;
+    *m = regression.m;
+    free_simple_regression(&regression);
+    return status;
+}
+
+// Fit and plot ../data/data.txt, returns 0 on success and -1 if there is no line to show
+int simple_regression(void) {
+    return run_simple_regression(1);
+}
+
+// simple_regression() without rendering the plot, for batch jobs that only need the coefficients
+int simple_regression_no_plot(void) {
+    return run_simple_regression(0);
+}
+
+// Reset the running statistics to an empty stream
+void init_simple_stats(SimpleStats *stats) {
+    stats->count = 0;
+    stats->mean_x = stats->mean_y = 0.0;
+    stats->m2_x = stats->c_xy = 0.0;
+}
+
+// Add the point (x, y) to the running statistics (Welford's online update)
+void update_simple_stats(SimpleStats *stats, double x, double y) {
+    double dx, dy;
+
+    stats->count++;
+    dx = x - stats->mean_x;
+    dy = y - stats->mean_y;
+    stats->mean_x += dx / stats->count;
+    stats->mean_y += dy / stats->count;
+
+    // use the old deviation of one variable and the new deviation of the other
+    stats->m2_x += dx * (x - stats->mean_x);
+    stats->c_xy += dx * (y - stats->mean_y);
+}
+
+// Returns (c, m) for the line of best fit through the points seen so far, or a vector of size 0 if they do not
+// determine a line
+Vector solve_simple_stats(SimpleStats *stats) {
+    Vector c_m;
+    c_m.size = 0;
+    c_m.stride = 1;
+    c_m.data = NULL;
+
+    if (stats->count < 2 || stats->m2_x == 0.0) {
+        printf("ERROR in simple regression. Need at least 2 points with distinct x values but got %lld points\n", stats->count);
+        return c_m;
+    }
+
+    c_m.size = 2;
+    c_m.data = (double*)malloc(2 * sizeof(double));
+
+    c_m.data[1] = stats->c_xy / stats->m2_x;
+    c_m.data[0] = stats->mean_y - c_m.data[1] * stats->mean_x;
+
+    return c_m;
+}
+
+// Add a row in format 'y,x' to the running statistics
+static int accumulate_point(const double *row, int cols, void *ctx) {
+    if (cols >= 2) {
+        update_simple_stats((SimpleStats*)ctx, row[1], row[0]);
+    }
+    return 0;
+}
+
+// Simple linear regression in one pass over the input in O(1) memory - the points are not kept so nothing is plotted
+int simple_regression_streaming(void) {
+    SimpleStats stats;
+    IngestStats ingest_stats;
+
+    printf("Running Streaming Simple Linear Regression on Input from `../data/data.txt`\n");
+
+    init_simple_stats(&stats);
+    if (ingest_rows("../data/data.txt", accumulate_point, &stats, &ingest_stats) != 0) {
+        return -1;
+    }
+    print_ingest_stats("../data/data.txt", &ingest_stats);
+
+    Vector res = solve_simple_stats(&stats);
+    if (res.size == 0) {
+        return -1;
+    }
+
     // Printing in y = mx + c format, rounding coefficients to 2dp
     printf("Your regression line equation is:\n");
     printf("y = %.2fx + %.2f\n", res.data[1], res.data[0]);
     save_line(res.data[1], res.data[0]);
-    plot_results(data_inputs, res);
 
-    // Free used memory
-    free(data_inputs.x_inputs.data);
-    free(data_inputs.y_inputs.data);
-    free(X.data);
-    free(X_T.data);
-    free(X_TX.data);
-    free(inverse_X_TX.data);
-    free(final_matrix.data);
     free(res.data);
+    return 0;
 }
 
-int main(void) {
-    simple_regression();
-    return 0;
-}
\ No newline at end of file
+int main(int argc, char **argv) {
+    // --stream: fit without loading the data into memory (no plot)
+    // --no-plot: load the data and fit, but skip rendering the plot
+    if (argc > 1 && strcmp(argv[1], "--stream") == 0) {
+        return simple_regression_streaming() == 0 ? 0 : 1;
+    } else if (argc > 1 && strcmp(argv[1], "--no-plot") == 0) {
+        return simple_regression_no_plot() == 0 ? 0 : 1;
+    }
+    return simple_regression() == 0 ? 0 : 1;
+}
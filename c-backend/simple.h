@@ -1,25 +1,66 @@
 #include <stdio.h>
 #include "linalg.h"
+#include "ingest.h"
 
 // STRUCTS
 struct DataInputs;
 typedef struct DataInputs DataInputs;
 
+struct SimpleStats;
+typedef struct SimpleStats SimpleStats;
+
+struct SimpleRegression;
+typedef struct SimpleRegression SimpleRegression;
+
 // Struct for the 2 vector inputs of x and y values
 struct DataInputs {
     Vector x_inputs;
     Vector y_inputs;
 };
 
-// FUNCTION DEFINITIONS
-int count_lines(char *filename);
-double *get_padded_points(double *points, double min, double max, int length, double pad_amount);
+// Struct for the running sufficient statistics of a stream of (x, y) points
+// Means and centred sums are updated with Welford's method so no large sums cancel
+struct SimpleStats {
+    long long count;
+    double mean_x, mean_y;
+    double m2_x;  // sum of (x - mean_x)^2
+    double c_xy;  // sum of (x - mean_x) * (y - mean_y)
+};
 
+// Struct for one simple regression problem: its input points and the fitted line y = m*x + c
+// All state lives in the struct, so separate problems can be loaded and fitted on different threads at once
+struct SimpleRegression {
+    DataInputs data_inputs;
+    IngestStats ingest_stats;
+    double c, m;
+    int fitted;
+    Workspace workspace; // reset on every fit, workspace.peak is the most memory a fit has needed
+};
+
+// FUNCTION DEFINITIONS
 DataInputs read_data(void);
 
-Matrix gen_X(Vector x_values);
-Vector get_min_max(double *data_values, int length);
+Matrix gen_X(Workspace *ws, Vector x_values);
+Vector get_min_max(double *data_values, size_t length);
 
 void save_line(double m, double c);
+DataInputs downsample_points(DataInputs data_inputs, double min_x, double max_x, int columns, int per_column);
 void plot_results(DataInputs data_inputs, Vector c_m);
-void simple_regression(void);
\ No newline at end of file
+int plot_results_to(DataInputs data_inputs, Vector c_m, char *filename);
+void init_simple_stats(SimpleStats *stats);
+void update_simple_stats(SimpleStats *stats, double x, double y);
+Vector solve_simple_stats(SimpleStats *stats);
+
+Vector simple_regression_fit(Workspace *ws, DataInputs data_inputs);
+void init_simple_regression(SimpleRegression *regression);
+int load_simple_regression_file(SimpleRegression *regression, char *filename);
+int load_simple_regression_buffer(SimpleRegression *regression, const char *data, size_t length);
+int fit_simple_regression(SimpleRegression *regression);
+int plot_simple_regression(SimpleRegression *regression, char *filename);
+void free_simple_regression(SimpleRegression *regression);
+int simple_regression_from_file(char *filename, double *c, double *m);
+int simple_regression_from_buffer(const char *data, size_t length, double *c, double *m);
+
+int simple_regression(void);
+int simple_regression_no_plot(void);
+int simple_regression_streaming(void);
\ No newline at end of file